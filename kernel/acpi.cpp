@@ -64,7 +64,21 @@ namespace acpi {
     return (this->header.length - sizeof(DescriptionHeader)) / sizeof(uint64_t);
   }
 
+  const uint8_t* MADT::FindEntry(uint8_t type) const {
+    auto p = reinterpret_cast<const uint8_t*>(this + 1);
+    const auto end = reinterpret_cast<const uint8_t*>(this) + this->header.length;
+    while (p + 2 <= end && p[1] >= 2) {
+      if (p[0] == type) {
+        return p;
+      }
+      p += p[1];
+    }
+    return nullptr;
+  }
+
   const FADT* fadt;
+  const HPET* hpet;
+  const MADT* madt;
 
   void WaitMilliseconds(unsigned long msec) {
     const bool pm_timer_32 = (fadt->flags >> 8) & 1;
@@ -93,11 +107,16 @@ namespace acpi {
     }
 
     fadt = nullptr;
+    hpet = nullptr;
+    madt = nullptr;
     for (int i = 0; i < xsdt.Count(); ++i) {
       const auto& entry = xsdt[i];
       if (entry.IsValid("FACP")) { // 歴史的な事情により FADT のシグネチャは "FACP"
         fadt = reinterpret_cast<const FADT*>(&entry);
-        break;
+      } else if (entry.IsValid("HPET")) {
+        hpet = reinterpret_cast<const HPET*>(&entry);
+      } else if (entry.IsValid("APIC")) { // MADT のシグネチャは "APIC"
+        madt = reinterpret_cast<const MADT*>(&entry);
       }
     }
 
@@ -55,7 +55,57 @@ namespace acpi {
     char reserved3[276 - 116];
   } __attribute__((packed));
 
+  /** @brief ACPI Generic Address Structure */
+  struct GenericAddress {
+    uint8_t address_space_id; // 0: システムメモリ, 1: I/O 空間
+    uint8_t register_bit_width;
+    uint8_t register_bit_offset;
+    uint8_t access_size;
+    uint64_t address;
+  } __attribute__((packed));
+
+  /** @brief HPET Description Table */
+  struct HPET {
+    DescriptionHeader header;
+
+    uint32_t event_timer_block_id;
+    GenericAddress base_address;
+    uint8_t hpet_number;
+    uint16_t main_counter_minimum;
+    uint8_t page_protection;
+  } __attribute__((packed));
+
+  /** @brief Multiple APIC Description Table
+   *
+   * ヘッダの後ろに可変長のエントリ（Interrupt Controller Structure）が続く。
+   */
+  struct MADT {
+    DescriptionHeader header;
+
+    uint32_t local_apic_address;
+    uint32_t flags;
+
+    /** @brief 指定された種別のエントリを先頭から探す。見つからなければ nullptr。 */
+    const uint8_t* FindEntry(uint8_t type) const;
+  } __attribute__((packed));
+
+  /** @brief MADT エントリ種別 1: I/O APIC */
+  struct MADTIOAPIC {
+    uint8_t type;
+    uint8_t length;
+    uint8_t io_apic_id;
+    uint8_t reserved;
+    uint32_t io_apic_address;
+    uint32_t global_system_interrupt_base;
+  } __attribute__((packed));
+
+  const uint8_t kMADTTypeIOAPIC = 1;
+
   extern const FADT* fadt;
+  /** @brief HPET テーブル。存在しなければ nullptr。 */
+  extern const HPET* hpet;
+  /** @brief MADT。存在しなければ nullptr。 */
+  extern const MADT* madt;
   const int kPMTimerFreq = 3579545;
 
   void WaitMilliseconds(unsigned long msec);
@@ -22,6 +22,20 @@ IoIn32:
     in eax, dx
     ret
 
+global IoOut8  ; void IoOut8(uint16_t addr, uint8_t data);
+IoOut8:
+    mov dx, di    ; dx = addr
+    mov al, sil   ; al = data
+    out dx, al
+    ret
+
+global IoIn8  ; uint8_t IoIn8(uint16_t addr);
+IoIn8:
+    mov dx, di    ; dx = addr
+    xor eax, eax
+    in al, dx
+    ret
+
 global GetCS  ; uint16_t GetCS(void);
 GetCS:
     xor eax, eax  ; also clears upper 32 bits of rax
@@ -52,6 +66,11 @@ LoadGDT:
     pop rbp
     ret
 
+global LoadTR  ; void LoadTR(uint16_t sel);
+LoadTR:
+    ltr di
+    ret
+
 global SetCSSS  ; void SetCSSS(uint16_t cs, uint16_t ss);
 SetCSSS:
     push rbp
@@ -84,6 +103,108 @@ GetCR3:
     mov rax, cr3
     ret
 
+global GetCR2  ; uint64_t GetCR2();
+GetCR2:
+    mov rax, cr2
+    ret
+
+global InvalidateTLB  ; void InvalidateTLB(uint64_t addr);
+InvalidateTLB:
+    invlpg [rdi]
+    ret
+
+global GetCR0  ; uint64_t GetCR0();
+GetCR0:
+    mov rax, cr0
+    ret
+
+global SetCR0  ; void SetCR0(uint64_t value);
+SetCR0:
+    mov cr0, rdi
+    ret
+
+global GetCR4  ; uint64_t GetCR4();
+GetCR4:
+    mov rax, cr4
+    ret
+
+global SetCR4  ; void SetCR4(uint64_t value);
+SetCR4:
+    mov cr4, rdi
+    ret
+
+global ClearTS  ; void ClearTS();
+ClearTS:
+    clts
+    ret
+
+global ReadCPUID  ; void ReadCPUID(uint32_t leaf, uint32_t subleaf,
+                  ;                uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d);
+ReadCPUID:
+    push rbx        ; RBX は callee-saved
+    mov r10, rdx    ; a
+    mov r11, rcx    ; b
+    mov eax, edi
+    mov ecx, esi
+    cpuid
+    mov [r10], eax
+    mov [r11], ebx
+    mov [r8], ecx
+    mov [r9], edx
+    pop rbx
+    ret
+
+global ReadTSC  ; uint64_t ReadTSC();
+ReadTSC:
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global SetXCR0  ; void SetXCR0(uint64_t value);
+SetXCR0:
+    mov rax, rdi
+    mov rdx, rdi
+    shr rdx, 32
+    xor ecx, ecx
+    xsetbv
+    ret
+
+global FXSave  ; void FXSave(void* area);
+FXSave:
+    fxsave [rdi]
+    ret
+
+global FXRstor  ; void FXRstor(const void* area);
+FXRstor:
+    fxrstor [rdi]
+    ret
+
+; XSAVE 系命令は EDX:EAX で保存・復帰する状態のビットマスクを受け取る
+global XSave  ; void XSave(void* area, uint64_t mask);
+XSave:
+    mov rax, rsi
+    mov rdx, rsi
+    shr rdx, 32
+    xsave [rdi]
+    ret
+
+global XSaveOpt  ; void XSaveOpt(void* area, uint64_t mask);
+XSaveOpt:
+    mov rax, rsi
+    mov rdx, rsi
+    shr rdx, 32
+    xsaveopt [rdi]
+    ret
+
+global XRstor  ; void XRstor(const void* area, uint64_t mask);
+XRstor:
+    mov rax, rsi
+    mov rdx, rsi
+    shr rdx, 32
+    xrstor [rdi]
+    ret
+
 extern kernel_main_stack
 extern KernelMainNewStack
 
@@ -133,7 +254,10 @@ SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     mov dx, gs
     mov [rsi + 0x38], rdx
 
-    fxsave [rsi + 0xc0]
+    ; FPU/SSE 状態は切り替えず、次に使われたときに #NM で切り替える
+    mov rax, cr0
+    or rax, 0x08  ; CR0.TS
+    mov cr0, rax
 
     ; iret 用のスタックフレーム
     push qword [rdi + 0x28] ; SS
@@ -143,8 +267,6 @@ SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     push qword [rdi + 0x08] ; RIP
 
     ; コンテキストの復帰
-    fxrstor [rdi + 0xc0]
-
     mov rax, [rdi + 0x00]
     mov cr3, rax
     mov rax, [rdi + 0x30]
@@ -170,3 +292,13 @@ SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     mov rdi, [rdi + 0x60]
 
     o64 iret
+
+extern ExitCurrentTask
+
+global TaskReturnTrampoline
+TaskReturnTrampoline:  ; タスク関数から戻ってきたときの戻り先
+    xor edi, edi
+    call ExitCurrentTask  ; void ExitCurrentTask(int exit_code); 戻らない
+.fin:
+    hlt
+    jmp .fin
@@ -5,12 +5,32 @@
 extern "C" {
   void IoOut32(uint16_t addr, uint32_t data);
   uint32_t IoIn32(uint16_t addr);
+  void IoOut8(uint16_t addr, uint8_t data);
+  uint8_t IoIn8(uint16_t addr);
   uint32_t GetCS(void);
   void LoadIDT(uint16_t limit, uint64_t offset);
   void LoadGDT(uint16_t limit, uint64_t offset);
+  void LoadTR(uint16_t sel);
   void SetCSSS(uint16_t cs, uint16_t ss);
   void SetDSAll(uint16_t value);
   void SetCR3(uint64_t value);
   uint64_t GetCR3();
+  uint64_t GetCR2();
+  void InvalidateTLB(uint64_t addr);
+  uint64_t GetCR0();
+  void SetCR0(uint64_t value);
+  uint64_t GetCR4();
+  void SetCR4(uint64_t value);
+  void ClearTS();
+  void ReadCPUID(uint32_t leaf, uint32_t subleaf,
+                 uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d);
+  uint64_t ReadTSC();
+  void SetXCR0(uint64_t value);
+  void FXSave(void* area);
+  void FXRstor(const void* area);
+  void XSave(void* area, uint64_t mask);
+  void XSaveOpt(void* area, uint64_t mask);
+  void XRstor(const void* area, uint64_t mask);
   void SwitchContext(void* next_ctx, void* current_ctx);
+  void TaskReturnTrampoline();
 }
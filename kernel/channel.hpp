@@ -0,0 +1,146 @@
+/**
+ * @file channel.hpp
+ *
+ * 任意のタスク間で型付きのデータを直接やり取りするチャネルを提供する。
+ *
+ * Message と違い、送るデータの型はチャネルごとに決まり、メインタスクを経由しない。
+ * MakeChannel で作った送信側と受信側のハンドルをそれぞれのタスクに渡して使う。
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "error.hpp"
+#include "spinlock.hpp"
+#include "sync.hpp"
+
+/** @brief 容量が固定のリングバッファで T を受け渡すチャネル。
+ *
+ * 送信側と受信側で共有し、Sender / Receiver を通して使う。
+ * 眠って待つ Send と Receive はタスクからのみ呼べる。
+ * TrySend と TryReceive は眠らないので割り込みハンドラからも呼べる。
+ */
+template <class T>
+class Channel {
+ public:
+  explicit Channel(size_t capacity) : buf_(capacity > 0 ? capacity : 1) {}
+  Channel(const Channel&) = delete;
+  Channel& operator=(const Channel&) = delete;
+
+  size_t Capacity() const { return buf_.size(); }
+
+  /** @brief 空きができるまで眠って待ってから value を送る。 */
+  Error Send(T value) {
+    LockGuard guard{lock_};
+    while (!closed_ && count_ == buf_.size()) {
+      not_full_.Wait(lock_);
+    }
+    return PushLocked(std::move(value));
+  }
+
+  /** @brief 空きがあれば value を送る。満杯なら kFull を返す。 */
+  Error TrySend(T value) {
+    LockGuard guard{lock_};
+    if (!closed_ && count_ == buf_.size()) {
+      return MAKE_ERROR(Error::kFull);
+    }
+    return PushLocked(std::move(value));
+  }
+
+  /** @brief データが届くまで眠って待って受け取る。閉じられて空になったら kChannelClosed を返す。 */
+  Error Receive(T& value) {
+    LockGuard guard{lock_};
+    while (!closed_ && count_ == 0) {
+      not_empty_.Wait(lock_);
+    }
+    return PopLocked(value);
+  }
+
+  /** @brief データがあれば受け取る。空なら kEmpty を返す。 */
+  Error TryReceive(T& value) {
+    LockGuard guard{lock_};
+    if (!closed_ && count_ == 0) {
+      return MAKE_ERROR(Error::kEmpty);
+    }
+    return PopLocked(value);
+  }
+
+  /** @brief 以降の送信を拒否し、待っているタスクをすべて起こす。残っているデータは受け取れる。 */
+  void Close() {
+    LockGuard guard{lock_};
+    closed_ = true;
+    not_empty_.WakeAll();
+    not_full_.WakeAll();
+  }
+
+ private:
+  SpinLock lock_;
+  WaitQueue not_empty_, not_full_;
+  std::vector<T> buf_;
+  size_t head_{0}, count_{0};
+  bool closed_{false};
+
+  Error PushLocked(T value) {
+    if (closed_) {
+      return MAKE_ERROR(Error::kChannelClosed);
+    }
+    buf_[(head_ + count_) % buf_.size()] = std::move(value);
+    count_++;
+    not_empty_.WakeOne();
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error PopLocked(T& value) {
+    if (count_ == 0) {
+      return MAKE_ERROR(Error::kChannelClosed);
+    }
+    value = std::move(buf_[head_]);
+    head_ = (head_ + 1) % buf_.size();
+    count_--;
+    not_full_.WakeOne();
+    return MAKE_ERROR(Error::kSuccess);
+  }
+};
+
+/** @brief チャネルの送信側のハンドル。コピーして複数のタスクから送ってよい。 */
+template <class T>
+class Sender {
+ public:
+  Sender() = default;
+  explicit Sender(std::shared_ptr<Channel<T>> ch) : ch_{std::move(ch)} {}
+
+  bool Valid() const { return static_cast<bool>(ch_); }
+  Error Send(T value) const { return ch_->Send(std::move(value)); }
+  Error TrySend(T value) const { return ch_->TrySend(std::move(value)); }
+  void Close() const { ch_->Close(); }
+
+ private:
+  std::shared_ptr<Channel<T>> ch_;
+};
+
+/** @brief チャネルの受信側のハンドル */
+template <class T>
+class Receiver {
+ public:
+  Receiver() = default;
+  explicit Receiver(std::shared_ptr<Channel<T>> ch) : ch_{std::move(ch)} {}
+
+  bool Valid() const { return static_cast<bool>(ch_); }
+  Error Receive(T& value) const { return ch_->Receive(value); }
+  Error TryReceive(T& value) const { return ch_->TryReceive(value); }
+  void Close() const { ch_->Close(); }
+
+ private:
+  std::shared_ptr<Channel<T>> ch_;
+};
+
+/** @brief 容量 capacity のチャネルを作り、送信側と受信側のハンドルを返す。 */
+template <class T>
+std::pair<Sender<T>, Receiver<T>> MakeChannel(size_t capacity) {
+  auto ch = std::make_shared<Channel<T>>(capacity);
+  return {Sender<T>{ch}, Receiver<T>{ch}};
+}
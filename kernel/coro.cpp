@@ -0,0 +1,133 @@
+#include "coro.hpp"
+
+#include "timer.hpp"
+
+namespace {
+  /** @brief Executor::Spawn で開始したコルーチンを包み、完了したらフレームを自動的に解放する。 */
+  struct DetachedTask {
+    struct promise_type {
+      DetachedTask get_return_object() { return {}; }
+      coro::suspend_never initial_suspend() noexcept { return {}; }
+      coro::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() {
+        while (true) __asm__("hlt");
+      }
+    };
+  };
+
+  DetachedTask RunDetached(coro::Executor* executor, coro::Task<void> task) {
+    // 呼び出し側ではなくワーカータスク上で開始する
+    co_await executor->Yield();
+    co_await std::move(task);
+  }
+}
+
+namespace coro {
+  Executor::Executor() : drain_work_{Drain, reinterpret_cast<int64_t>(this)} {
+  }
+
+  void Executor::Schedule(coroutine_handle<> h) {
+    {
+      LockGuard guard{lock_};
+      ready_.push_back(h);
+    }
+    work_queue->Schedule(&drain_work_);
+  }
+
+  void Executor::ScheduleAfter(unsigned long ticks, coroutine_handle<> h) {
+    const unsigned long deadline = timer_manager->CurrentTick() + ticks;
+    {
+      LockGuard guard{lock_};
+      sleeping_.insert({deadline, h});
+    }
+    timer_manager->AddTimer(Timer{deadline, kCoroutineTimerValue});
+  }
+
+  void Executor::Spawn(Task<void> task) {
+    RunDetached(this, std::move(task));
+  }
+
+  void Executor::OnTimer(unsigned long timeout) {
+    {
+      LockGuard guard{lock_};
+      auto end = sleeping_.upper_bound(timeout);
+      for (auto it = sleeping_.begin(); it != end; ++it) {
+        ready_.push_back(it->second);
+      }
+      sleeping_.erase(sleeping_.begin(), end);
+    }
+    work_queue->Schedule(&drain_work_);
+  }
+
+  void Executor::Drain(int64_t data) {
+    auto executor = reinterpret_cast<Executor*>(data);
+    while (true) {
+      coroutine_handle<> h;
+      {
+        LockGuard guard{executor->lock_};
+        if (executor->ready_.empty()) {
+          return;
+        }
+        h = executor->ready_.front();
+        executor->ready_.pop_front();
+      }
+      h.resume();
+    }
+  }
+
+  Executor* executor;
+
+  bool Event::IsSet() {
+    LockGuard guard{lock_};
+    return set_;
+  }
+
+  void Event::Set() {
+    LockGuard guard{lock_};
+    set_ = true;
+    for (auto h : waiters_) {
+      executor->Schedule(h);
+    }
+    waiters_.clear();
+  }
+
+  void Event::Reset() {
+    LockGuard guard{lock_};
+    set_ = false;
+  }
+
+  bool Event::AddWaiter(coroutine_handle<> h) {
+    LockGuard guard{lock_};
+    if (set_) {
+      return false;
+    }
+    waiters_.push_back(h);
+    return true;
+  }
+
+  bool Mutex::Acquire(coroutine_handle<> h) {
+    LockGuard guard{lock_};
+    if (!locked_) {
+      locked_ = true;
+      return false;
+    }
+    waiters_.push_back(h);
+    return true;
+  }
+
+  void Mutex::Unlock() {
+    LockGuard guard{lock_};
+    if (waiters_.empty()) {
+      locked_ = false;
+      return;
+    }
+    // locked_ を保ったまま、次に待っているコルーチンへ所有権を渡す
+    executor->Schedule(waiters_.front());
+    waiters_.pop_front();
+  }
+
+  void InitializeExecutor() {
+    executor = new Executor;
+  }
+}
@@ -0,0 +1,237 @@
+/**
+ * @file coro.hpp
+ *
+ * C++20 のコルーチンでデバイスドライバなどの非同期処理を書くための仕組み。
+ *
+ * coro::Task<T> は呼び出し側が co_await するまで開始しない遅延コルーチン。
+ * 中断したコルーチンは Executor に登録され、ワークキューのワーカータスク上で再開される。
+ * そのため、同じ Executor で動くコルーチン同士は互いに並行には動かない。
+ */
+
+#pragma once
+
+#if __has_include(<coroutine>)
+#include <coroutine>
+#else
+#include <experimental/coroutine>
+#endif
+
+#include <deque>
+#include <map>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "spinlock.hpp"
+#include "workqueue.hpp"
+
+namespace coro {
+
+#if __has_include(<coroutine>)
+  using std::coroutine_handle;
+  using std::noop_coroutine;
+  using std::suspend_always;
+  using std::suspend_never;
+#else
+  using std::experimental::coroutine_handle;
+  using std::experimental::noop_coroutine;
+  using std::experimental::suspend_always;
+  using std::experimental::suspend_never;
+#endif
+
+  template <class T = void>
+  class Task;
+
+  namespace detail {
+    /** @brief 完了したら、co_await していたコルーチンへ直接制御を移す。 */
+    struct FinalAwaiter {
+      bool await_ready() const noexcept { return false; }
+
+      template <class Promise>
+      coroutine_handle<> await_suspend(coroutine_handle<Promise> h) noexcept {
+        if (auto continuation = h.promise().continuation) {
+          return continuation;
+        }
+        return noop_coroutine();
+      }
+
+      void await_resume() const noexcept {}
+    };
+
+    struct PromiseBase {
+      coroutine_handle<> continuation{};
+
+      suspend_always initial_suspend() noexcept { return {}; }
+      FinalAwaiter final_suspend() noexcept { return {}; }
+      void unhandled_exception() {
+        while (true) __asm__("hlt");
+      }
+    };
+
+    template <class T>
+    struct Promise : PromiseBase {
+      std::optional<T> value;
+
+      Task<T> get_return_object();
+      void return_value(T v) { value.emplace(std::move(v)); }
+      T Result() { return std::move(*value); }
+    };
+
+    template <>
+    struct Promise<void> : PromiseBase {
+      Task<void> get_return_object();
+      void return_void() {}
+      void Result() {}
+    };
+  }
+
+  /** @brief 値 T を返すコルーチン。
+   *
+   * co_await すると開始し、完了すると co_await した側が結果を受け取って再開する。
+   * 呼び出し側を待たせずに開始するには Executor::Spawn を使う。
+   */
+  template <class T>
+  class Task {
+   public:
+    using promise_type = detail::Promise<T>;
+    using Handle = coroutine_handle<promise_type>;
+
+    explicit Task(Handle h) : h_{h} {}
+    Task(Task&& rhs) noexcept : h_{std::exchange(rhs.h_, {})} {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+      if (h_) {
+        h_.destroy();
+      }
+    }
+
+    auto operator co_await() && noexcept {
+      struct Awaiter {
+        Handle h;
+        bool await_ready() const noexcept { return false; }
+        coroutine_handle<> await_suspend(coroutine_handle<> caller) noexcept {
+          h.promise().continuation = caller;
+          return h;
+        }
+        T await_resume() { return h.promise().Result(); }
+      };
+      return Awaiter{h_};
+    }
+
+   private:
+    Handle h_;
+  };
+
+  namespace detail {
+    template <class T>
+    Task<T> Promise<T>::get_return_object() {
+      return Task<T>{Task<T>::Handle::from_promise(*this)};
+    }
+
+    inline Task<void> Promise<void>::get_return_object() {
+      return Task<void>{Task<void>::Handle::from_promise(*this)};
+    }
+  }
+
+  /** @brief 中断したコルーチンを実行待ち行列に積み、ワーカータスク上で再開する。 */
+  class Executor {
+   public:
+    Executor();
+
+    /** @brief h を実行待ちにする。割り込みハンドラからも呼べる。 */
+    void Schedule(coroutine_handle<> h);
+    /** @brief ticks 回のタイマー割り込みの後に h を実行待ちにする。 */
+    void ScheduleAfter(unsigned long ticks, coroutine_handle<> h);
+    /** @brief 呼び出し側を待たせずに task を開始する。完了したら自動的に破棄する。 */
+    void Spawn(Task<void> task);
+    /** @brief 期限 timeout のタイマーが満了したとき TimerManager から呼ばれる。 */
+    void OnTimer(unsigned long timeout);
+
+    /** @brief 一度 Executor に制御を返し、後で再開する。 */
+    auto Yield() {
+      struct Awaiter {
+        Executor* executor;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(coroutine_handle<> h) { executor->Schedule(h); }
+        void await_resume() const noexcept {}
+      };
+      return Awaiter{this};
+    }
+
+   private:
+    SpinLock lock_;
+    std::deque<coroutine_handle<>> ready_{};
+    std::multimap<unsigned long, coroutine_handle<>> sleeping_{};
+    Work drain_work_;
+
+    static void Drain(int64_t data);
+  };
+
+  extern Executor* executor;
+
+  /** @brief ticks 回のタイマー割り込みの間、コルーチンを中断する。 */
+  inline auto SleepFor(unsigned long ticks) {
+    struct Awaiter {
+      unsigned long ticks;
+      bool await_ready() const noexcept { return ticks == 0; }
+      void await_suspend(coroutine_handle<> h) { executor->ScheduleAfter(ticks, h); }
+      void await_resume() const noexcept {}
+    };
+    return Awaiter{ticks};
+  }
+
+  /** @brief Set されるまで待つコルーチンを溜めておくイベント。Reset するまでセット状態が続く。 */
+  class Event {
+   public:
+    bool IsSet();
+    /** @brief 待っているコルーチンをすべて実行待ちにする。割り込みハンドラからも呼べる。 */
+    void Set();
+    void Reset();
+
+    auto Wait() {
+      struct Awaiter {
+        Event* event;
+        bool await_ready() { return event->IsSet(); }
+        bool await_suspend(coroutine_handle<> h) { return event->AddWaiter(h); }
+        void await_resume() const noexcept {}
+      };
+      return Awaiter{this};
+    }
+
+   private:
+    SpinLock lock_;
+    bool set_{false};
+    std::vector<coroutine_handle<>> waiters_{};
+
+    /** @return 中断したままにするなら true、すでにセットされていたなら false */
+    bool AddWaiter(coroutine_handle<> h);
+  };
+
+  /** @brief コルーチン用の排他ロック。取得できるまでタスクではなくコルーチンを中断する。 */
+  class Mutex {
+   public:
+    auto Lock() {
+      struct Awaiter {
+        Mutex* mutex;
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(coroutine_handle<> h) { return mutex->Acquire(h); }
+        void await_resume() const noexcept {}
+      };
+      return Awaiter{this};
+    }
+
+    /** @brief ロックを解放する。待っているコルーチンがあればそれに所有権を渡す。 */
+    void Unlock();
+
+   private:
+    SpinLock lock_;
+    bool locked_{false};
+    std::deque<coroutine_handle<>> waiters_{};
+
+    /** @return 取得できずに中断するなら true */
+    bool Acquire(coroutine_handle<> h);
+  };
+
+  void InitializeExecutor();
+}
@@ -29,6 +29,9 @@ class Error {
     kNoPCIMSI,
     kUnknownPixelFormat,
     kNoSuchTask,
+    kTimeout,
+    kValueMismatch,
+    kChannelClosed,
     kLastOfCode,  // この列挙子は常に最後に配置する
   };
 
@@ -57,6 +60,9 @@ class Error {
     "kNoPCIMSI",
     "kUnknownPixelFormat",
     "kNoSuchTask",
+    "kTimeout",
+    "kValueMismatch",
+    "kChannelClosed",
   };
 
  public:
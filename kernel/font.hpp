@@ -3,5 +3,36 @@
 #include <cstdint>
 #include "graphics.hpp"
 
-void WriteAscii(PixelWriter& writer, Vector2D<int> pos, char c, const PixelColor& color);
-void WriteString(PixelWriter& writer, Vector2D<int> pos, const char* s, const PixelColor& color);
+/** @brief 文字 c の 8x16 ドットのフォントを返す。フォントがなければ nullptr。 */
+const uint8_t* GetFont(char c);
+
+/** @brief Writer には PixelWriter の派生クラスか Surface<Format> を指定できる。 */
+template <class Writer>
+void WriteAscii(Writer& writer, Vector2D<int> pos, char c, const PixelColor& color) {
+  const uint8_t* font = GetFont(c);
+  if (font == nullptr) {
+    return;
+  }
+  for (int dy = 0; dy < 16; ++dy) {
+    // 連続して立っているビットを 1 本の横線として塗る
+    int dx = 0;
+    while (dx < 8) {
+      if (((font[dy] << dx) & 0x80u) == 0) {
+        ++dx;
+        continue;
+      }
+      const int run_begin = dx;
+      while (dx < 8 && ((font[dy] << dx) & 0x80u)) {
+        ++dx;
+      }
+      writer.FillSpan(pos + Vector2D<int>{run_begin, dy}, dx - run_begin, color);
+    }
+  }
+}
+
+template <class Writer>
+void WriteString(Writer& writer, Vector2D<int> pos, const char* s, const PixelColor& color) {
+  for(int i = 0; s[i] != '\0'; ++i) {
+    WriteAscii(writer, pos + Vector2D<int>{8 * i, 0}, s[i], color);
+  }
+}
@@ -0,0 +1,108 @@
+#include "fpu.hpp"
+
+#include "asmfunc.h"
+#include "logger.hpp"
+
+namespace {
+  const uint64_t kCR4OSXSAVE = 1u << 18;
+
+  const uint64_t kXCR0X87 = 1u << 0;
+  const uint64_t kXCR0SSE = 1u << 1;
+  const uint64_t kXCR0AVX = 1u << 2;
+  // AVX-512 は opmask, ZMM_Hi256, Hi16_ZMM の 3 つをまとめて有効化する必要がある
+  const uint64_t kXCR0AVX512 = (1u << 5) | (1u << 6) | (1u << 7);
+
+  bool avx2_supported = false;
+  bool use_xsave = false;
+  bool use_xsaveopt = false;
+  uint64_t xsave_mask = 0;
+  size_t state_bytes = 512;
+}
+
+FPUState::FPUState() : buf_(state_bytes + 63) {
+  area_ = reinterpret_cast<uint8_t*>(
+      (reinterpret_cast<uintptr_t>(buf_.data()) + 63) & ~static_cast<uintptr_t>(63));
+  Reset();
+}
+
+void FPUState::Reset() {
+  memset(area_, 0, state_bytes);
+  // FCW の初期値は FNINIT 後と同じ、MXCSR はすべての例外をマスクする
+  *reinterpret_cast<uint16_t*>(&area_[0]) = 0x037f;
+  *reinterpret_cast<uint32_t*>(&area_[24]) = 0x1f80;
+}
+
+void FPUState::Save() {
+  if (use_xsaveopt) {
+    XSaveOpt(area_, xsave_mask);
+  } else if (use_xsave) {
+    XSave(area_, xsave_mask);
+  } else {
+    FXSave(area_);
+  }
+}
+
+void FPUState::Restore() const {
+  if (use_xsave) {
+    XRstor(area_, xsave_mask);
+  } else {
+    FXRstor(area_);
+  }
+}
+
+size_t FPUStateBytes() {
+  return state_bytes;
+}
+
+bool AVXEnabled() {
+  return (xsave_mask & kXCR0AVX) != 0;
+}
+
+bool AVX2Enabled() {
+  return AVXEnabled() && avx2_supported;
+}
+
+bool AVX512Enabled() {
+  return (xsave_mask & kXCR0AVX512) == kXCR0AVX512;
+}
+
+void InitializeFPU() {
+  uint32_t a, b, c, d;
+  ReadCPUID(1, 0, &a, &b, &c, &d);
+  if (((c >> 26) & 1) == 0) { // XSAVE
+    Log(kInfo, "XSAVE is not supported; using FXSAVE\n");
+    return;
+  }
+  const bool avx_supported = (c >> 28) & 1;
+
+  SetCR4(GetCR4() | kCR4OSXSAVE);
+
+  // CPUID.(EAX=0DH,ECX=0):EDX:EAX は XCR0 に設定可能なビット
+  ReadCPUID(0xd, 0, &a, &b, &c, &d);
+  const uint64_t supported = (static_cast<uint64_t>(d) << 32) | a;
+
+  xsave_mask = kXCR0X87 | kXCR0SSE;
+  if (avx_supported && (supported & kXCR0AVX)) {
+    xsave_mask |= kXCR0AVX;
+    if ((supported & kXCR0AVX512) == kXCR0AVX512) {
+      xsave_mask |= kXCR0AVX512;
+    }
+  }
+  SetXCR0(xsave_mask);
+  use_xsave = true;
+
+  ReadCPUID(0, 0, &a, &b, &c, &d);
+  if (a >= 7) {
+    ReadCPUID(7, 0, &a, &b, &c, &d);
+    avx2_supported = (b >> 5) & 1;
+  }
+
+  // EBX は現在の XCR0 で有効な状態をすべて保存するのに必要なバイト数
+  ReadCPUID(0xd, 0, &a, &b, &c, &d);
+  state_bytes = b;
+
+  ReadCPUID(0xd, 1, &a, &b, &c, &d);
+  use_xsaveopt = (a & 1) != 0;
+  Log(kInfo, "XSAVE enabled: xcr0=%lx, %lu bytes, xsaveopt=%d\n",
+      xsave_mask, state_bytes, use_xsaveopt);
+}
@@ -0,0 +1,59 @@
+/**
+ * @file fpu.hpp
+ *
+ * FPU/SSE 状態の保存・復帰を行うプログラムを集めたファイル。
+ *
+ * タスク切り替え時には状態を切り替えず、CR0.TS をセットしておく。
+ * タスクが FPU/SSE 命令を実行すると #NM 例外が発生するので、
+ * そこで初めて状態を入れ替える（遅延切り替え）。
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/** @brief 1 タスク分の FPU/SSE/AVX 状態を保持する。
+ *
+ * 保存領域の大きさは FPUStateBytes() で決まり、タスクごとにヒープから確保する。
+ */
+class FPUState {
+ public:
+  FPUState();
+  FPUState(const FPUState&) = delete;
+  FPUState& operator=(const FPUState&) = delete;
+
+  /** @brief 保存領域を初期状態に戻す。 */
+  void Reset();
+  /** @brief 現在の FPU/SSE レジスタの内容を保存する。 */
+  void Save();
+  /** @brief 保存されている内容を FPU/SSE レジスタに復帰する。 */
+  void Restore() const;
+
+ private:
+  std::vector<uint8_t> buf_;
+  /** @brief buf_ 内の 64 バイト境界に揃えた保存領域 */
+  uint8_t* area_;
+};
+
+/** @brief FPUState が使う保存領域のバイト数を返す。
+ *
+ * XSAVE が使える場合は CPUID.(EAX=0DH,ECX=0):EBX から求めた、
+ * XCR0 で有効にした状態をすべて保存できる大きさとなる。
+ */
+size_t FPUStateBytes();
+
+/** @brief AVX (YMM レジスタ) の状態がタスク切り替えで保存されるなら真を返す。 */
+bool AVXEnabled();
+/** @brief AVX2 命令が使えるなら真を返す。 */
+bool AVX2Enabled();
+/** @brief AVX-512 の状態がタスク切り替えで保存されるなら真を返す。 */
+bool AVX512Enabled();
+
+/** @brief XSAVE 系命令の有無を調べ、使用可能なら有効化する。
+ *
+ * XCR0 には CPU が対応している範囲で x87, SSE, AVX, AVX-512 を設定する。
+ * タスク管理を初期化する前に呼ぶこと。
+ */
+void InitializeFPU();
@@ -35,11 +35,12 @@ Error FrameBuffer::Initialize(const FrameBufferConfig& config) {
   if (config_.frame_buffer) {
     buffer_.resize(0);
   } else {
+    // 各行の先頭が 32 バイト境界からずれないよう、1 行のピクセル数を 8 の倍数に揃える
+    config_.pixels_per_scan_line = (config_.horizontal_resolution + 7) & ~7u;
     buffer_.resize(
       bytes_per_pixel
-      * config_.horizontal_resolution * config_.vertical_resolution);
+      * config_.pixels_per_scan_line * config_.vertical_resolution);
     config_.frame_buffer = buffer_.data();
-    config_.pixels_per_scan_line = config_.horizontal_resolution;
   }
 
   switch (config_.pixel_format) {
@@ -93,7 +94,7 @@ void FrameBuffer::Move(Vector2D<int> dst_pos, const Rectangle<int>& src) {
     uint8_t* dst_buf = FrameAddrAt(dst_pos, config_);
     const uint8_t* src_buf = FrameAddrAt(src.pos, config_);
     for (int y = 0; y < src.size.y; y++) {
-      memcpy(dst_buf, src_buf, bytes_per_pixel * src.size.x);
+      memmove(dst_buf, src_buf, bytes_per_pixel * src.size.x);
       dst_buf += bytes_per_scan_line;
       src_buf += bytes_per_scan_line;
     }
@@ -101,7 +102,7 @@ void FrameBuffer::Move(Vector2D<int> dst_pos, const Rectangle<int>& src) {
     uint8_t* dst_buf = FrameAddrAt(dst_pos + Vector2D<int>{0, src.size.y - 1}, config_);
     const uint8_t* src_buf = FrameAddrAt(src.pos + Vector2D<int>{0, src.size.y - 1}, config_);
     for (int y = 0; y < src.size.y; y++) {
-      memcpy(dst_buf, src_buf, bytes_per_pixel * src.size.x);
+      memmove(dst_buf, src_buf, bytes_per_pixel * src.size.x);
       dst_buf -= bytes_per_scan_line;
       src_buf -= bytes_per_scan_line;
     }
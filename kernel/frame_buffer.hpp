@@ -14,6 +14,13 @@ class FrameBuffer {
   void Move(Vector2D<int> dst_pos, const Rectangle<int>& src);
 
   FrameBufferWriter& Writer() { return *writer_; }
+  /** @brief y 行目の先頭ピクセルを指す。1 ピクセルは 32 ビット。 */
+  uint32_t* RowAt(int y) {
+    return reinterpret_cast<uint32_t*>(config_.frame_buffer) + config_.pixels_per_scan_line * y;
+  }
+  const uint32_t* RowAt(int y) const {
+    return reinterpret_cast<const uint32_t*>(config_.frame_buffer) + config_.pixels_per_scan_line * y;
+  }
   const FrameBufferConfig& Config() const { return config_; }
 
  private:
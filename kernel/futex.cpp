@@ -0,0 +1,99 @@
+#include "futex.hpp"
+
+#include <deque>
+
+#include "spinlock.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace {
+  struct Waiter {
+    const volatile uint32_t* addr;
+    Task* task;
+    bool woken;
+  };
+
+  struct Bucket {
+    SpinLock lock;
+    std::deque<Waiter*> waiters;
+  };
+
+  const size_t kNumBuckets = 64;
+  Bucket* buckets;
+
+  Bucket& BucketFor(const volatile uint32_t* addr) {
+    auto key = reinterpret_cast<uintptr_t>(addr) >> 2;
+    key ^= key >> 6;
+    key *= 0x9e3779b97f4a7c15ull;
+    return buckets[(key >> 32) % kNumBuckets];
+  }
+
+  void RemoveWaiter(Bucket& bucket, Waiter* waiter) {
+    for (auto it = bucket.waiters.begin(); it != bucket.waiters.end(); ++it) {
+      if (*it == waiter) {
+        bucket.waiters.erase(it);
+        return;
+      }
+    }
+  }
+}
+
+Error WaitOnAddress(const volatile uint32_t* addr, uint32_t expected,
+                    unsigned long timeout_ticks) {
+  Task& task = task_manager->CurrentTask();
+  Bucket& bucket = BucketFor(addr);
+
+  unsigned long deadline = 0;
+  uint64_t timer_id = 0;
+  if (timeout_ticks > 0) {
+    // 期限に一度だけ起こしてもらう。先に戻るときは必ず取り消し、
+    // 後で無関係な理由で眠っているこのタスクを起こさないようにする。
+    deadline = timer_manager->CurrentTick() + timeout_ticks;
+    timer_id = timer_manager->AddTimer(Timer{deadline, kWakeupTimerValue, task.ID()});
+  }
+
+  LockGuard guard{bucket.lock};
+  if (*addr != expected) {
+    timer_manager->CancelTimer(timer_id);
+    return MAKE_ERROR(Error::kValueMismatch);
+  }
+
+  Waiter waiter{addr, &task, false};
+  bucket.waiters.push_back(&waiter);
+
+  while (!waiter.woken) {
+    if (deadline > 0 && timer_manager->CurrentTick() >= deadline) {
+      RemoveWaiter(bucket, &waiter);
+      timer_manager->CancelTimer(timer_id);
+      return MAKE_ERROR(Error::kTimeout);
+    }
+    bucket.lock.ReleaseWhile([&task]{ task.Sleep(); });
+  }
+  timer_manager->CancelTimer(timer_id);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+int WakeAddress(const volatile uint32_t* addr, int n) {
+  Bucket& bucket = BucketFor(addr);
+  LockGuard guard{bucket.lock};
+
+  int num_woken = 0;
+  auto it = bucket.waiters.begin();
+  while (it != bucket.waiters.end() && num_woken < n) {
+    Waiter* waiter = *it;
+    if (waiter->addr != addr) {
+      ++it;
+      continue;
+    }
+
+    it = bucket.waiters.erase(it);
+    waiter->woken = true;
+    waiter->task->Wakeup();
+    ++num_woken;
+  }
+  return num_woken;
+}
+
+void InitializeFutex() {
+  buckets = new Bucket[kNumBuckets];
+}
@@ -0,0 +1,31 @@
+/**
+ * @file futex.hpp
+ *
+ * メモリ上の 32 ビット値を使って待ち合わせる仕組み（futex）を提供する。
+ *
+ * 値の確認と更新はロックフリーに行い、待つ必要があるときだけ WaitOnAddress で眠る。
+ * 待っているタスクはアドレスのハッシュで選んだバケットの待ち行列に並ぶ。
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "error.hpp"
+
+/** @brief *addr == expected である間、WakeAddress で起こされるまで眠る。
+ *
+ * 値の確認と待ち行列への登録はバケットのロックを保持して行うので、
+ * 値を書き換えてから WakeAddress を呼ぶ側との間で起床を取りこぼさない。
+ *
+ * @param timeout_ticks  タイムアウトまでのタイマー割り込み回数。0 なら無期限に待つ。
+ * @return 起こされたら kSuccess、*addr != expected なら kValueMismatch、
+ *   時間切れなら kTimeout
+ */
+Error WaitOnAddress(const volatile uint32_t* addr, uint32_t expected,
+                    unsigned long timeout_ticks = 0);
+
+/** @brief addr で待っているタスクを最大 n 個起こし、起こした数を返す。 */
+int WakeAddress(const volatile uint32_t* addr, int n);
+
+void InitializeFutex();
@@ -6,60 +6,215 @@
 
 #include "graphics.hpp"
 
+#include <immintrin.h>
+
+#include "fpu.hpp"
+#include "surface.hpp"
+
 void RGBResv8BitPerColorPixelWriter::Write(Vector2D<int> pos, const PixelColor& c) {
-  auto p = PixelAt(pos);
-  p[0] = c.r;
-  p[1] = c.g;
-  p[2] = c.b;
+  auto p = reinterpret_cast<uint32_t*>(PixelAt(pos));
+  *p = PackPixel(kPixelRGBResv8BitPerColor, c);
 }
 
 void BGRResv8BitPerColorPixelWriter::Write(Vector2D<int> pos, const PixelColor& c) {
-  auto p = PixelAt(pos);
-  p[0] = c.b;
-  p[1] = c.g;
-  p[2] = c.r;
+  auto p = reinterpret_cast<uint32_t*>(PixelAt(pos));
+  *p = PackPixel(kPixelBGRResv8BitPerColor, c);
 }
 
-void DrawRectangle(PixelWriter& writer, const Vector2D<int>& pos,
-                   const Vector2D<int>& size, const PixelColor& c) {
-  for (int dx = 0; dx < size.x; ++dx) {
-    writer.Write(pos + Vector2D<int>{dx, 0}, c);
-    writer.Write(pos + Vector2D<int>{dx, size.y - 1}, c);
-  }
-  for (int dy = 1; dy < size.y - 1; ++dy) {
-    writer.Write(pos + Vector2D<int>{0, dy}, c);
-    writer.Write(pos + Vector2D<int>{size.x - 1, dy}, c);
+void PixelWriter::FillSpan(Vector2D<int> pos, int len, const PixelColor& c) {
+  for (int dx = 0; dx < len; ++dx) {
+    Write(pos + Vector2D<int>{dx, 0}, c);
   }
 }
 
-void FillRectangle(PixelWriter& writer, const Vector2D<int>& pos,
-                   const Vector2D<int>& size, const PixelColor& c) {
+void PixelWriter::FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor& c) {
   for (int dy = 0; dy < size.y; ++dy) {
-    for (int dx = 0; dx < size.x; ++dx) {
-      writer.Write(pos + Vector2D<int>{dx, dy}, c);
+    FillSpan(pos + Vector2D<int>{0, dy}, size.x, c);
+  }
+}
+
+void PixelWriter::WriteRow(Vector2D<int> pos, const PixelColor* colors, int len) {
+  for (int dx = 0; dx < len; ++dx) {
+    Write(pos + Vector2D<int>{dx, 0}, colors[dx]);
+  }
+}
+
+namespace {
+  __attribute__((target("avx2")))
+  uint32_t* FillPixels32AVX2(uint32_t* dst, uint32_t value, int& n) {
+    const __m256i v = _mm256_set1_epi32(value);
+    for (; n >= 8; n -= 8, dst += 8) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), v);
     }
+    return dst;
+  }
+
+  uint32_t* FillPixels32SSE2(uint32_t* dst, uint32_t value, int& n) {
+    const __m128i v = _mm_set1_epi32(value);
+    for (; n >= 4; n -= 4, dst += 4) {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), v);
+    }
+    return dst;
   }
 }
 
-void DrawDesktop(PixelWriter& writer) {
-  const auto width = writer.Width();
-  const auto height = writer.Height();
-  FillRectangle(writer,
-                {0, 0},
-                {width, height - 50},
-                kDesktopBGColor);
-  FillRectangle(writer,
-                {0, height - 50},
-                {width, 50},
-                {1, 8, 17});
-  FillRectangle(writer,
-                {0, height - 50},
-                {width / 5, 50},
-                {80, 80, 80});
-  DrawRectangle(writer,
-                {10, height - 40},
-                {30, 30},
-                {160, 160, 160});
+void FillPixels32(uint32_t* dst, uint32_t value, int n) {
+  // AVX を有効にするのは InitializeFPU の後なので、それまでは SSE2 だけを使う
+  if (n >= 8 && AVX2Enabled()) {
+    dst = FillPixels32AVX2(dst, value, n);
+  }
+  dst = FillPixels32SSE2(dst, value, n);
+  for (; n > 0; --n) {
+    *dst++ = value;
+  }
+}
+
+namespace {
+  // 乗算済みアルファの合成: dst = src * opacity + dst * (1 - src.a * opacity)
+  // 各チャネルを 16 ビットに広げ、MulDiv255 と同じ丸めで掛け算する。
+
+  __attribute__((target("avx2")))
+  __m256i MulDiv255x16(__m256i x, __m256i k) {
+    const __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(x, k), _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+  }
+
+  /** @brief 16 ビットに広げた 4 ピクセル分について、各ピクセルのアルファを全チャネルに複製する。 */
+  __attribute__((target("avx2")))
+  __m256i BroadcastAlpha(__m256i x) {
+    return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(x, 0xff), 0xff);
+  }
+
+  __attribute__((target("avx2")))
+  int BlendPixels32AVX2(uint32_t* dst, const uint32_t* src, int n,
+                        uint8_t opacity, uint32_t alpha_mask) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i op = _mm256_set1_epi16(opacity);
+    const __m256i max = _mm256_set1_epi16(255);
+    const __m256i mask = _mm256_set1_epi32(alpha_mask);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+      const __m256i s = _mm256_or_si256(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)), mask);
+      const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+
+      __m256i s_lo = _mm256_unpacklo_epi8(s, zero), s_hi = _mm256_unpackhi_epi8(s, zero);
+      if (opacity != 255) {
+        s_lo = MulDiv255x16(s_lo, op);
+        s_hi = MulDiv255x16(s_hi, op);
+      }
+      const __m256i d_lo = MulDiv255x16(_mm256_unpacklo_epi8(d, zero),
+                                        _mm256_sub_epi16(max, BroadcastAlpha(s_lo)));
+      const __m256i d_hi = MulDiv255x16(_mm256_unpackhi_epi8(d, zero),
+                                        _mm256_sub_epi16(max, BroadcastAlpha(s_hi)));
+      const __m256i out = _mm256_packus_epi16(_mm256_adds_epu16(s_lo, d_lo),
+                                              _mm256_adds_epu16(s_hi, d_hi));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), out);
+    }
+    return i;
+  }
+
+  __m128i MulDiv255x8(__m128i x, __m128i k) {
+    const __m128i t = _mm_add_epi16(_mm_mullo_epi16(x, k), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+  }
+
+  __m128i BroadcastAlpha(__m128i x) {
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xff), 0xff);
+  }
+
+  int BlendPixels32SSE2(uint32_t* dst, const uint32_t* src, int n,
+                        uint8_t opacity, uint32_t alpha_mask) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i op = _mm_set1_epi16(opacity);
+    const __m128i max = _mm_set1_epi16(255);
+    const __m128i mask = _mm_set1_epi32(alpha_mask);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+      const __m128i s = _mm_or_si128(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)), mask);
+      const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+
+      __m128i s_lo = _mm_unpacklo_epi8(s, zero), s_hi = _mm_unpackhi_epi8(s, zero);
+      if (opacity != 255) {
+        s_lo = MulDiv255x8(s_lo, op);
+        s_hi = MulDiv255x8(s_hi, op);
+      }
+      const __m128i d_lo = MulDiv255x8(_mm_unpacklo_epi8(d, zero),
+                                       _mm_sub_epi16(max, BroadcastAlpha(s_lo)));
+      const __m128i d_hi = MulDiv255x8(_mm_unpackhi_epi8(d, zero),
+                                       _mm_sub_epi16(max, BroadcastAlpha(s_hi)));
+      const __m128i out = _mm_packus_epi16(_mm_adds_epu16(s_lo, d_lo),
+                                           _mm_adds_epu16(s_hi, d_hi));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), out);
+    }
+    return i;
+  }
+
+  uint32_t BlendPixel(uint32_t d, uint32_t s, uint8_t opacity) {
+    uint32_t out = 0;
+    const uint32_t inv_alpha = 255 - MulDiv255(s >> 24, opacity);
+    for (int shift = 0; shift < 32; shift += 8) {
+      const uint32_t c = MulDiv255((s >> shift) & 0xff, opacity) +
+                         MulDiv255((d >> shift) & 0xff, inv_alpha);
+      out |= std::min<uint32_t>(c, 255) << shift;
+    }
+    return out;
+  }
+}
+
+void BlendPixels32(uint32_t* dst, const uint32_t* src, int n,
+                   uint8_t opacity, bool src_opaque) {
+  const uint32_t alpha_mask = src_opaque ? 0xff000000u : 0;
+  int i = 0;
+  if (n >= 8 && AVX2Enabled()) {
+    i = BlendPixels32AVX2(dst, src, n, opacity, alpha_mask);
+  }
+  i += BlendPixels32SSE2(dst + i, src + i, n - i, opacity, alpha_mask);
+  for (; i < n; ++i) {
+    dst[i] = BlendPixel(dst[i], src[i] | alpha_mask, opacity);
+  }
+}
+
+namespace {
+  /** @brief [pos.x, pos.x + len) を [0, width) に切り詰め、切り落とした左側の幅を返す。 */
+  int ClipSpan(Vector2D<int>& pos, int& len, int width) {
+    const int skip = pos.x < 0 ? -pos.x : 0;
+    pos.x += skip;
+    len = std::min(len - skip, width - pos.x);
+    return skip;
+  }
+}
+
+void FrameBufferWriter::FillSpan(Vector2D<int> pos, int len, const PixelColor& c) {
+  FillRect(pos, {len, 1}, c);
+}
+
+void FrameBufferWriter::FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor& c) {
+  ClipSpan(pos, size.x, Width());
+  const int y_end = std::min(pos.y + size.y, Height());
+  const int y_begin = std::max(pos.y, 0);
+  if (size.x <= 0) {
+    return;
+  }
+
+  const uint32_t value = PackPixel(config_.pixel_format, c);
+  for (int y = y_begin; y < y_end; ++y) {
+    FillPixels32(reinterpret_cast<uint32_t*>(PixelAt({pos.x, y})), value, size.x);
+  }
+}
+
+void FrameBufferWriter::WriteRow(Vector2D<int> pos, const PixelColor* colors, int len) {
+  if (pos.y < 0 || pos.y >= Height()) {
+    return;
+  }
+  colors += ClipSpan(pos, len, Width());
+
+  auto p = reinterpret_cast<uint32_t*>(PixelAt(pos));
+  const auto format = config_.pixel_format;
+  for (int i = 0; i < len; ++i) {
+    p[i] = PackPixel(format, colors[i]);
+  }
 }
 
 FrameBufferConfig screen_config;
@@ -92,5 +247,5 @@ void InitializeGraphics(const FrameBufferConfig& screen_config) {
       exit(1);
   }
 
-  DrawDesktop(*screen_writer);
+  VisitSurface(screen_config, [](auto surface) { DrawDesktop(surface); });
 }
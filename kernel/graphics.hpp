@@ -6,6 +6,8 @@
 
 struct PixelColor {
   uint8_t r, g, b;
+  /** @brief 不透明度。アルファ付きのウィンドウでのみ意味を持ち、比較には使わない。 */
+  uint8_t a{255};
 };
 
 constexpr PixelColor ToColor(uint32_t c) {
@@ -94,8 +96,65 @@ class PixelWriter {
     virtual void Write(Vector2D<int> pos, const PixelColor& c) = 0;
     virtual int Width() const = 0;
     virtual int Height() const = 0;
+
+    // 以下はまとめて書き込むための関数。既定の実装は Write を繰り返すので、
+    // 派生クラスはより速い方法があれば上書きする。
+
+    /** @brief pos から右へ len ピクセルを c で塗る。 */
+    virtual void FillSpan(Vector2D<int> pos, int len, const PixelColor& c);
+    /** @brief pos を左上とする size の矩形を c で塗る。 */
+    virtual void FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor& c);
+    /** @brief pos から右へ colors[0] 〜 colors[len - 1] を書く。 */
+    virtual void WriteRow(Vector2D<int> pos, const PixelColor* colors, int len);
 };
 
+/** @brief dst から n 個の 32 ビット値を value で埋める。使えるなら AVX2 か SSE2 でまとめて書く。 */
+void FillPixels32(uint32_t* dst, uint32_t value, int n);
+
+/** @brief dst[0] 〜 dst[n - 1] に src を重ねる。
+ *
+ * ピクセルは最上位バイトをアルファとする乗算済みアルファ形式として扱う。
+ * src は opacity / 255 倍してから重ねる。src_opaque なら src のアルファを 255 とみなす。
+ * 使えるなら AVX2 で 8 ピクセル、SSE2 で 4 ピクセルずつ処理する。
+ */
+void BlendPixels32(uint32_t* dst, const uint32_t* src, int n,
+                   uint8_t opacity, bool src_opaque);
+
+/** @brief 0 〜 255 の値 x に k / 255 を掛ける（四捨五入）。 */
+inline uint8_t MulDiv255(unsigned int x, unsigned int k) {
+  const unsigned int t = x * k + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+/** @brief 画素形式 format の 1 ピクセル分の 32 ビット値を作る。
+ *
+ * 予約バイトにはアルファを入れ、色はアルファを乗算済みにする。
+ */
+inline uint32_t PackPixel(PixelFormat format, const PixelColor& c) {
+  uint32_t r = c.r, g = c.g, b = c.b;
+  if (c.a != 255) {
+    r = MulDiv255(r, c.a);
+    g = MulDiv255(g, c.a);
+    b = MulDiv255(b, c.a);
+  }
+  const uint32_t a = static_cast<uint32_t>(c.a) << 24;
+  if (format == kPixelBGRResv8BitPerColor) {
+    return b | (g << 8) | (r << 16) | a;
+  }
+  return r | (g << 8) | (b << 16) | a;
+}
+
+/** @brief PackPixel の逆変換 */
+inline PixelColor UnpackPixel(PixelFormat format, uint32_t v) {
+  const auto b0 = static_cast<uint8_t>(v), b1 = static_cast<uint8_t>(v >> 8),
+             b2 = static_cast<uint8_t>(v >> 16);
+  if (format == kPixelBGRResv8BitPerColor) {
+    return {b2, b1, b0};
+  }
+  return {b0, b1, b2};
+}
+
+/** @brief 1 ピクセル 32 ビットのフレームバッファに書き込む。まとめて書く関数は画面外をはみ出さないよう切り詰める。 */
 class FrameBufferWriter : public PixelWriter {
  public:
   FrameBufferWriter(const FrameBufferConfig& config) : config_{config} {}
@@ -103,6 +162,10 @@ class FrameBufferWriter : public PixelWriter {
   virtual int Width() const override { return config_.horizontal_resolution; }
   virtual int Height() const override { return config_.vertical_resolution; }
 
+  virtual void FillSpan(Vector2D<int> pos, int len, const PixelColor& c) override;
+  virtual void FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor& c) override;
+  virtual void WriteRow(Vector2D<int> pos, const PixelColor* colors, int len) override;
+
  protected:
   uint8_t* PixelAt(Vector2D<int> pos) {
     return config_.frame_buffer + 4 * (config_.pixels_per_scan_line * pos.y + pos.x);
@@ -128,15 +191,51 @@ class BGRResv8BitPerColorPixelWriter : public FrameBufferWriter {
     virtual void Write(Vector2D<int> pos, const PixelColor& c) override;
 };
 
-void DrawRectangle(PixelWriter& writer, const Vector2D<int>& pos,
-                    const Vector2D<int>& size, const PixelColor& c);
-void FillRectangle(PixelWriter& writer, const Vector2D<int>& pos,
-                    const Vector2D<int>& size, const PixelColor& c);
+// 以下の描画関数の Writer には PixelWriter の派生クラスか Surface<Format> を指定できる。
+// Surface を渡せば、内側のループで仮想関数を呼ばない。
+
+template <class Writer>
+void DrawRectangle(Writer& writer, const Vector2D<int>& pos,
+                   const Vector2D<int>& size, const PixelColor& c) {
+  if (size.x <= 0 || size.y <= 0) {
+    return;
+  }
+  writer.FillSpan(pos, size.x, c);
+  writer.FillSpan(pos + Vector2D<int>{0, size.y - 1}, size.x, c);
+  writer.FillRect(pos + Vector2D<int>{0, 1}, {1, size.y - 2}, c);
+  writer.FillRect(pos + Vector2D<int>{size.x - 1, 1}, {1, size.y - 2}, c);
+}
+
+template <class Writer>
+void FillRectangle(Writer& writer, const Vector2D<int>& pos,
+                   const Vector2D<int>& size, const PixelColor& c) {
+  writer.FillRect(pos, size, c);
+}
 
 const PixelColor kDesktopBGColor{45, 118, 237};
 const PixelColor kDesktopFGColor{255, 255, 255};
 
-void DrawDesktop(PixelWriter& writer);
+template <class Writer>
+void DrawDesktop(Writer& writer) {
+  const auto width = writer.Width();
+  const auto height = writer.Height();
+  FillRectangle(writer,
+                {0, 0},
+                {width, height - 50},
+                kDesktopBGColor);
+  FillRectangle(writer,
+                {0, height - 50},
+                {width, 50},
+                {1, 8, 17});
+  FillRectangle(writer,
+                {0, height - 50},
+                {width / 5, 50},
+                {80, 80, 80});
+  DrawRectangle(writer,
+                {10, height - 40},
+                {30, 30},
+                {160, 160, 160});
+}
 
 extern FrameBufferConfig screen_config;
 extern PixelWriter* screen_writer;
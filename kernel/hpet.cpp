@@ -0,0 +1,184 @@
+#include "hpet.hpp"
+
+#include <algorithm>
+#include "acpi.hpp"
+#include "interrupt.hpp"
+#include "ioapic.hpp"
+#include "logger.hpp"
+
+namespace {
+  const uintptr_t kGeneralCapabilities = 0x000;
+  const uintptr_t kGeneralConfiguration = 0x010;
+  const uintptr_t kGeneralInterruptStatus = 0x020;
+  const uintptr_t kMainCounter = 0x0f0;
+
+  uintptr_t TimerConfiguration(unsigned int n) { return 0x100 + 0x20 * n; }
+  uintptr_t TimerComparator(unsigned int n) { return 0x108 + 0x20 * n; }
+  uintptr_t TimerFSBRoute(unsigned int n) { return 0x110 + 0x20 * n; }
+
+  const uint64_t kEnable = 1u << 0;
+  const uint64_t kCountSize64 = 1u << 13;
+
+  const uint64_t kTimerLevelTrigger = 1u << 1;
+  const uint64_t kTimerInterruptEnable = 1u << 2;
+  const uint64_t kTimerPeriodic = 1u << 3;
+  const uint64_t kTimer64BitCapable = 1u << 5;
+  const uint64_t kTimerRouteMask = 0x1fu << 9;
+  const uint64_t kTimerFSBEnable = 1u << 14;
+  const uint64_t kTimerFSBCapable = 1u << 15;
+
+  const uint64_t kFemtosecondsPerSecond = 1000000000000000ul;
+
+  const std::array<uint8_t, HPET::kMaxEventComparators> comparator_vectors{
+    InterruptVector::kHPETComparator0,
+    InterruptVector::kHPETComparator1,
+    InterruptVector::kHPETComparator2,
+  };
+
+  uint8_t BSPLocalAPICID() {
+    return *reinterpret_cast<const uint32_t*>(0xfee00020) >> 24;
+  }
+}
+
+HPET::HPET(uintptr_t mmio_base) : mmio_base_{mmio_base} {
+  const uint64_t cap = Register(kGeneralCapabilities);
+  period_fs_ = cap >> 32;
+  frequency_ = kFemtosecondsPerSecond / period_fs_;
+  counter_mask_ = (cap & kCountSize64) ? ~0ul : 0xfffffffful;
+  num_timers_ = ((cap >> 8) & 0x1fu) + 1;
+
+  // レガシー置き換えを無効にし、全コンパレータを停止してからカウンタを動かす
+  Register(kGeneralConfiguration) = 0;
+  for (unsigned int i = 0; i < num_timers_; ++i) {
+    auto& config = Register(TimerConfiguration(i));
+    config = config & ~(kTimerInterruptEnable | kTimerPeriodic | kTimerFSBEnable);
+  }
+  Register(kMainCounter) = 0;
+  Register(kGeneralConfiguration) = kEnable;
+}
+
+uint64_t HPET::Counter() const {
+  return Register(kMainCounter) & counter_mask_;
+}
+
+uint64_t HPET::Nanoseconds() const {
+  // 128 ビットで計算してオーバーフローを避ける
+  return static_cast<unsigned __int128>(Counter()) * period_fs_ / 1000000;
+}
+
+void HPET::WaitMilliseconds(unsigned long msec) const {
+  const uint64_t start = Counter();
+  const uint64_t ticks = frequency_ * msec / 1000;
+  while (((Counter() - start) & counter_mask_) < ticks);
+}
+
+unsigned int HPET::NumComparators() const {
+  return std::min(num_timers_, kMaxEventComparators);
+}
+
+Error HPET::SetupOneShot(unsigned int comparator, EventHandler* handler) {
+  if (comparator >= NumComparators()) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  const auto vector = comparator_vectors[comparator];
+  const auto apic_id = BSPLocalAPICID();
+  uint64_t conf = Register(TimerConfiguration(comparator));
+  conf &= ~(kTimerLevelTrigger | kTimerInterruptEnable | kTimerPeriodic |
+            kTimerRouteMask | kTimerFSBEnable);
+
+  // 設定し直すなら、配送方法によらず、このコンパレータが使っていた GSI を先に手放す
+  if (const int old_gsi = comparator_gsis_[comparator]; old_gsi >= 0) {
+    ioapic::Mask(old_gsi);
+    used_gsis_ &= ~(1u << old_gsi);
+    comparator_gsis_[comparator] = -1;
+  }
+
+  if (conf & kTimerFSBCapable) {
+    // 上位 32 ビットにメッセージアドレス、下位 32 ビットにメッセージデータ
+    const uint64_t msg_addr = 0xfee00000u | (static_cast<uint32_t>(apic_id) << 12);
+    Register(TimerFSBRoute(comparator)) = (msg_addr << 32) | vector;
+    conf |= kTimerFSBEnable;
+  } else {
+    // ISA と共有しない GSI 16 以降を優先して選ぶ。
+    // 他のコンパレータが使っている GSI を選ぶとリダイレクションを上書きしてしまうので除く。
+    const uint32_t route_cap = conf >> 32;
+    int gsi = -1;
+    for (int i : {16, 17, 18, 19, 20, 21, 22, 23, 8, 2, 11, 10}) {
+      if (((route_cap >> i) & 1) && ((used_gsis_ >> i) & 1) == 0 &&
+          !ioapic::Redirect(i, vector, apic_id)) {
+        gsi = i;
+        break;
+      }
+    }
+    if (gsi < 0) {
+      return MAKE_ERROR(Error::kNotImplemented);
+    }
+    used_gsis_ |= 1u << gsi;
+    comparator_gsis_[comparator] = gsi;
+    conf |= static_cast<uint64_t>(gsi) << 9;
+  }
+
+  handlers_[comparator] = handler;
+  Register(TimerConfiguration(comparator)) = conf;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error HPET::ArmOneShot(unsigned int comparator, uint64_t delta_ticks) {
+  if (comparator >= NumComparators()) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  auto& config = Register(TimerConfiguration(comparator));
+  // 32 ビットのコンパレータはカウンタの下位 32 ビットとだけ比較される
+  const uint64_t mask = (config & kTimer64BitCapable) ? counter_mask_ : 0xfffffffful;
+
+  // 有効にしてから期限を書く。逆順だと、その間にカウンタが期限を追い越して発火しないことがある。
+  config = config | kTimerInterruptEnable;
+  const uint64_t deadline = (Counter() + delta_ticks) & mask;
+  Register(TimerComparator(comparator)) = deadline;
+
+  // 書き込みの間に割り込みや SMI が入り、カウンタがすでに期限に達していないか確かめる
+  const uint64_t elapsed = (Counter() - deadline) & mask;
+  if (elapsed <= (mask >> 1)) {
+    return MAKE_ERROR(Error::kTimeout);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void HPET::Disarm(unsigned int comparator) {
+  if (comparator < NumComparators()) {
+    auto& config = Register(TimerConfiguration(comparator));
+    config = config & ~kTimerInterruptEnable;
+  }
+}
+
+void HPET::OnInterrupt(unsigned int comparator) {
+  // エッジトリガでは不要だが、レベルトリガで設定された場合に備えてステータスを落とす
+  Register(kGeneralInterruptStatus) = 1u << comparator;
+  Disarm(comparator);
+  if (auto handler = handlers_[comparator]) {
+    handler(comparator);
+  }
+}
+
+HPET* hpet;
+
+void InitializeHPET() {
+  hpet = nullptr;
+  if (acpi::hpet == nullptr) {
+    Log(kWarn, "HPET is not found\n");
+    return;
+  }
+
+  const auto& base = acpi::hpet->base_address;
+  if (base.address_space_id != 0) {
+    Log(kWarn, "HPET is not memory mapped: space %d\n", base.address_space_id);
+    return;
+  }
+
+  // HPET のレジスタは 4GiB 未満に置かれ、アイデンティティマッピング済み
+  hpet = new HPET{base.address};
+  Log(kInfo, "HPET: %lu Hz, %u comparators\n",
+      hpet->Frequency(), hpet->NumComparators());
+}
@@ -0,0 +1,81 @@
+/**
+ * @file hpet.hpp
+ *
+ * HPET (High Precision Event Timer) を制御するプログラムを集めたファイル。
+ *
+ * メインカウンタを高分解能なクロックソースとして提供し、
+ * 各コンパレータをワンショットのイベント源として提供する。
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "error.hpp"
+
+class HPET {
+ public:
+  /** @brief コンパレータが発火したときに割り込みコンテキストで呼ばれる関数 */
+  using EventHandler = void (unsigned int comparator);
+  /** @brief イベント源として使えるコンパレータの最大数（割り込みベクタの数に対応） */
+  static const unsigned int kMaxEventComparators = 3;
+
+  HPET(uintptr_t mmio_base);
+
+  /** @brief メインカウンタの現在値を返す。 */
+  uint64_t Counter() const;
+  /** @brief メインカウンタの周波数 (Hz) を返す。 */
+  uint64_t Frequency() const { return frequency_; }
+  /** @brief メインカウンタの値をナノ秒単位に換算して返す。タイムスタンプ用。 */
+  uint64_t Nanoseconds() const;
+  /** @brief 指定したミリ秒だけビジーウェイトする。 */
+  void WaitMilliseconds(unsigned long msec) const;
+
+  /** @brief イベント源として使えるコンパレータの数を返す。 */
+  unsigned int NumComparators() const;
+  /** @brief コンパレータをワンショットのイベント源として設定する。
+   *
+   * FSB (MSI) 配送が可能ならそれを使い、そうでなければ I/O APIC 経由で配送する。
+   * I/O APIC 経由の場合、コンパレータごとに他と重ならない GSI を割り当てる。
+   * 設定直後は停止状態であり、ArmOneShot を呼ぶまで発火しない。
+   */
+  Error SetupOneShot(unsigned int comparator, EventHandler* handler);
+  /** @brief 現在から delta_ticks カウント後にコンパレータを発火させる。
+   *
+   * @return 設定を終えた時点でカウンタがすでに期限を過ぎていたら kTimeout。
+   *   その場合は発火しないことがあるので、呼び出し側はより大きな delta_ticks で呼び直すか、
+   *   期限が来たものとして扱う。
+   */
+  Error ArmOneShot(unsigned int comparator, uint64_t delta_ticks);
+  /** @brief コンパレータを停止する。 */
+  void Disarm(unsigned int comparator);
+
+  /** @brief 割り込みハンドラから呼ばれる。 */
+  void OnInterrupt(unsigned int comparator);
+
+ private:
+  const uintptr_t mmio_base_;
+  uint64_t period_fs_;
+  uint64_t frequency_;
+  uint64_t counter_mask_;
+  unsigned int num_timers_;
+  std::array<EventHandler*, kMaxEventComparators> handlers_{};
+  /** @brief I/O APIC 経由で配送するコンパレータが割り当て済みの GSI のビットマスク */
+  uint32_t used_gsis_{0};
+  /** @brief 各コンパレータに割り当てた GSI。FSB 配送か未設定なら -1。 */
+  std::array<int, kMaxEventComparators> comparator_gsis_{-1, -1, -1};
+
+  volatile uint64_t& Register(uintptr_t offset) const {
+    return *reinterpret_cast<volatile uint64_t*>(mmio_base_ + offset);
+  }
+};
+
+/** @brief HPET のインスタンス。HPET が存在しなければ nullptr。 */
+extern HPET* hpet;
+
+/** @brief ACPI の HPET テーブルを基に HPET を初期化する。
+ *
+ * acpi::Initialize と ioapic::Initialize の後に呼ぶこと。
+ */
+void InitializeHPET();
@@ -7,9 +7,14 @@
 #include "interrupt.hpp"
 
 #include "asmfunc.h"
+#include "logger.hpp"
 #include "segment.hpp"
 #include "timer.hpp"
 #include "task.hpp"
+#include "task_stack.hpp"
+#include "hpet.hpp"
+#include "workqueue.hpp"
+#include "usb/xhci/xhci.hpp"
 
 std::array<InterruptDescriptor, 256> idt;
 
@@ -30,19 +35,91 @@ void NotifyEndOfInterrupt() {
 }
 
 namespace {
+  __attribute__((interrupt))
+  void IntHandlerDeviceNotAvailable(InterruptFrame* frame) {
+    if (task_manager) {
+      task_manager->SwitchFPUOwner();
+    } else {
+      ClearTS();
+    }
+  }
+
+  [[noreturn]] void Halt() {
+    while (true) __asm__("cli\n\thlt");
+  }
+
+  // 以下の例外はタスクのスタックが溢れて起きることがあるので、IST のスタックで処理する
+
+  __attribute__((interrupt))
+  void IntHandlerDoubleFault(InterruptFrame* frame, uint64_t error_code) {
+    Log(kError, "#DF: rip=%lx rsp=%lx\n", frame->rip, frame->rsp);
+    Halt();
+  }
+
+  __attribute__((interrupt))
+  void IntHandlerPageFault(InterruptFrame* frame, uint64_t error_code) {
+    const uint64_t addr = GetCR2();
+    const uint64_t task_id = task_manager ? task_manager->CurrentTask().ID() : 0;
+    if (stack_allocator && stack_allocator->IsGuardPage(addr)) {
+      Log(kError, "stack overflow: task=%lu addr=%lx rip=%lx\n",
+          task_id, addr, frame->rip);
+    } else {
+      Log(kError, "#PF: task=%lu addr=%lx err=%lx rip=%lx\n",
+          task_id, addr, error_code, frame->rip);
+    }
+    Halt();
+  }
+
+  Work xhci_work{[](int64_t) { usb::xhci::ProcessEvents(); }};
+
   __attribute__((interrupt))
   void IntHandlerXHCI(InterruptFrame* frame) {
-    task_manager->SendMessage(1, Message{Message::kInterruptXHCI});
+    work_queue->Schedule(&xhci_work);
     NotifyEndOfInterrupt();
+
+    // ワーカータスクがすぐに動くべきなら、タイマー割り込みを待たずに切り替える
+    if (task_manager->ReschedulePending()) {
+      task_manager->SwitchTask();
+    }
   }
 
   __attribute__((interrupt))
   void IntHandlerLAPICTimer(InterruptFrame* frame) {
     LAPICTimerOnInterrupt();
   }
+
+  __attribute__((interrupt))
+  void IntHandlerHPETComparator0(InterruptFrame* frame) {
+    hpet->OnInterrupt(0);
+    NotifyEndOfInterrupt();
+  }
+
+  __attribute__((interrupt))
+  void IntHandlerHPETComparator1(InterruptFrame* frame) {
+    hpet->OnInterrupt(1);
+    NotifyEndOfInterrupt();
+  }
+
+  __attribute__((interrupt))
+  void IntHandlerHPETComparator2(InterruptFrame* frame) {
+    hpet->OnInterrupt(2);
+    NotifyEndOfInterrupt();
+  }
 }
 
 void InitializeInterrupt() {
+  SetIDTEntry(idt[InterruptVector::kDoubleFault],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0, true, kISTForException),
+              reinterpret_cast<uint64_t>(IntHandlerDoubleFault),
+              kKernelCS);
+  SetIDTEntry(idt[InterruptVector::kPageFault],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0, true, kISTForException),
+              reinterpret_cast<uint64_t>(IntHandlerPageFault),
+              kKernelCS);
+  SetIDTEntry(idt[InterruptVector::kDeviceNotAvailable],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+              reinterpret_cast<uint64_t>(IntHandlerDeviceNotAvailable),
+              kKernelCS);
   SetIDTEntry(idt[InterruptVector::kXHCI],
               MakeIDTAttr(DescriptorType::kInterruptGate, 0),
               reinterpret_cast<uint64_t>(IntHandlerXHCI),
@@ -51,5 +128,17 @@ void InitializeInterrupt() {
               MakeIDTAttr(DescriptorType::kInterruptGate, 0),
               reinterpret_cast<uint64_t>(IntHandlerLAPICTimer),
               kKernelCS);
+  SetIDTEntry(idt[InterruptVector::kHPETComparator0],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+              reinterpret_cast<uint64_t>(IntHandlerHPETComparator0),
+              kKernelCS);
+  SetIDTEntry(idt[InterruptVector::kHPETComparator1],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+              reinterpret_cast<uint64_t>(IntHandlerHPETComparator1),
+              kKernelCS);
+  SetIDTEntry(idt[InterruptVector::kHPETComparator2],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+              reinterpret_cast<uint64_t>(IntHandlerHPETComparator2),
+              kKernelCS);
   LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
 }
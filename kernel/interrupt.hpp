@@ -57,8 +57,14 @@ void SetIDTEntry(InterruptDescriptor& desc,
 class InterruptVector {
  public:
   enum Number {
+    kDeviceNotAvailable = 0x07,
+    kDoubleFault = 0x08,
+    kPageFault = 0x0e,
     kXHCI = 0x40,
     kLAPICTimer = 0x41,
+    kHPETComparator0 = 0x42,
+    kHPETComparator1 = 0x43,
+    kHPETComparator2 = 0x44,
   };
 };
 
@@ -0,0 +1,67 @@
+#include "ioapic.hpp"
+
+#include "acpi.hpp"
+#include "logger.hpp"
+
+namespace {
+  uintptr_t base_address = ioapic::kDefaultBaseAddress;
+  uint32_t gsi_base = 0;
+  uint32_t num_redirections = 0;
+
+  uint32_t ReadRegister(uint8_t index) {
+    *reinterpret_cast<volatile uint32_t*>(base_address) = index;
+    return *reinterpret_cast<volatile uint32_t*>(base_address + 0x10);
+  }
+
+  void WriteRegister(uint8_t index, uint32_t value) {
+    *reinterpret_cast<volatile uint32_t*>(base_address) = index;
+    *reinterpret_cast<volatile uint32_t*>(base_address + 0x10) = value;
+  }
+
+  WithError<uint8_t> RedirectionIndex(uint32_t gsi) {
+    if (gsi < gsi_base || gsi - gsi_base >= num_redirections) {
+      return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+    return {static_cast<uint8_t>(0x10 + 2 * (gsi - gsi_base)),
+            MAKE_ERROR(Error::kSuccess)};
+  }
+}
+
+namespace ioapic {
+  Error Redirect(uint32_t gsi, uint8_t vector, uint8_t apic_id) {
+    const auto index = RedirectionIndex(gsi);
+    if (index.error) {
+      return index.error;
+    }
+
+    // 上位: 配送先 APIC ID、下位: 固定配送・物理宛先・アクティブハイ・エッジトリガ・マスク解除
+    WriteRegister(index.value + 1, static_cast<uint32_t>(apic_id) << 24);
+    WriteRegister(index.value, vector);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Mask(uint32_t gsi) {
+    const auto index = RedirectionIndex(gsi);
+    if (index.error) {
+      return index.error;
+    }
+
+    WriteRegister(index.value, ReadRegister(index.value) | (1u << 16));
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  void Initialize() {
+    if (acpi::madt) {
+      if (auto p = acpi::madt->FindEntry(acpi::kMADTTypeIOAPIC)) {
+        auto entry = reinterpret_cast<const acpi::MADTIOAPIC*>(p);
+        base_address = entry->io_apic_address;
+        gsi_base = entry->global_system_interrupt_base;
+      }
+    }
+
+    // I/O APIC のアドレスは 4GiB 未満なのでアイデンティティマッピング済み
+    num_redirections = ((ReadRegister(0x01) >> 16) & 0xffu) + 1;
+    Log(kDebug, "I/O APIC: base %08lx, gsi %u-%u\n",
+        base_address, gsi_base, gsi_base + num_redirections - 1);
+  }
+}
@@ -0,0 +1,27 @@
+/**
+ * @file ioapic.hpp
+ *
+ * I/O APIC の割り込みリダイレクション設定を行うプログラムを集めたファイル。
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "error.hpp"
+
+namespace ioapic {
+  /** @brief MADT が見つからない場合に使う I/O APIC の標準的なアドレス */
+  const uintptr_t kDefaultBaseAddress = 0xfec00000;
+
+  /** @brief 指定された GSI (Global System Interrupt) の割り込みを vector に配送する。
+   *
+   * 配送先は apic_id で指定した Local APIC。エッジトリガ、アクティブハイで設定する。
+   */
+  Error Redirect(uint32_t gsi, uint8_t vector, uint8_t apic_id);
+  /** @brief 指定された GSI の割り込みをマスクする。 */
+  Error Mask(uint32_t gsi);
+
+  /** @brief MADT から I/O APIC の情報を読み取る。acpi::Initialize の後に呼ぶこと。 */
+  void Initialize();
+}
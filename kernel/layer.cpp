@@ -1,6 +1,7 @@
 #include "layer.hpp"
 
 #include <algorithm>
+#include <limits>
 #include "console.hpp"
 #include "logger.hpp"
 
@@ -43,9 +44,18 @@ Layer& Layer::MoveRelative(Vector2D<int> pos_diff) {
   return *this;
 }
 
+Layer& Layer::SetOpacity(uint8_t opacity) {
+  opacity_ = opacity;
+  return *this;
+}
+
+bool Layer::IsOpaque() const {
+  return opacity_ == 255 && window_ && window_->IsOpaque();
+}
+
 void Layer::DrawTo(FrameBuffer& screen, const Rectangle<int>& area) const {
-  if (window_) {
-    window_->DrawTo(screen, pos_, area);
+  if (window_ && opacity_ > 0) {
+    window_->DrawTo(screen, pos_, area, opacity_);
   }
 }
 
@@ -63,53 +73,248 @@ Layer& LayerManager::NewLayer() {
   return *layers_.emplace_back(new Layer{latest_id_});
 }
 
-void LayerManager::Draw(const Rectangle<int>& area) const {
-  for (auto layer : layer_stack_) {
-    layer->DrawTo(back_buffer_, area);
-  }
-  screen_->Copy(area.pos, back_buffer_, area);
+void LayerManager::Draw(const Rectangle<int>& area) {
+  Invalidate(area);
 }
 
-void LayerManager::Draw(unsigned int id) const {
+void LayerManager::Draw(unsigned int id) {
   Draw(id, {{0, 0}, {-1, -1}});
 }
 
-void LayerManager::Draw(unsigned int id, Rectangle<int> area) const {
-  bool draw = false;
-  Rectangle<int> window_area;
+void LayerManager::Draw(unsigned int id, Rectangle<int> area) {
+  auto layer = FindLayer(id);
+  if (!layer || !layer->GetWindow()) {
+    return;
+  }
+  Rectangle<int> window_area{layer->GetPosition(), layer->GetWindow()->Size()};
+  if (area.size.x >= 0 || area.size.y >= 0) {
+    area.pos = area.pos + window_area.pos;
+    window_area = window_area & area;
+  }
+  Invalidate(window_area);
+}
+
+void LayerManager::Invalidate(const Rectangle<int>& area) {
+  const Rectangle<int> screen_area{{0, 0}, {screen_->Writer().Width(), screen_->Writer().Height()}};
+  const auto clipped = area & screen_area;
+  if (IsEmpty(clipped)) {
+    return;
+  }
+
+  bool flush_now = false;
+  {
+    LockGuard guard{damage_lock_};
+    damage_.Add(clipped);
+    flush_now = !ScheduleFrameLocked();
+  }
+  if (flush_now) {
+    Flush();
+  }
+}
+
+bool LayerManager::RequestFrame() {
+  LockGuard guard{damage_lock_};
+  return ScheduleFrameLocked();
+}
+
+bool LayerManager::ScheduleFrameLocked() {
+  if (!frame_pacing_) {
+    return false;
+  }
+  if (!frame_scheduled_) {
+    frame_scheduled_ = true;
+    const unsigned long deadline = std::max(timer_manager->CurrentTick() + 1,
+                                            last_frame_tick_ + kFramePeriod);
+    timer_manager->AddTimer(Timer{deadline, kFrameTimerValue, frame_task_id_});
+  }
+  return true;
+}
+
+void LayerManager::Flush() {
+  Region damage, present;
+  {
+    LockGuard guard{damage_lock_};
+    std::swap(damage, damage_);
+    std::swap(present, present_);
+    frame_scheduled_ = false;
+    if (frame_pacing_) {
+      last_frame_tick_ = timer_manager->CurrentTick();
+    }
+  }
+  if (damage.Empty() && present.Empty()) {
+    return;
+  }
+
+  UpdateVisibleRegions();
+  for (const auto& area : damage.Rects()) {
+    Compose(area);
+    present.Subtract(area);
+  }
+  for (const auto& area : present.Rects()) {
+    screen_->Copy(area.pos, back_buffer_, area);
+    DrawCursor(area);
+    stats_.presented_pixels += AreaOf(area);
+  }
+  ++stats_.frames;
+}
+
+void LayerManager::StartFramePacing(uint64_t task_id) {
+  LockGuard guard{damage_lock_};
+  frame_task_id_ = task_id;
+  frame_pacing_ = true;
+}
+
+void LayerManager::UpdateVisibleRegions() {
+  const Rectangle<int> screen_area{{0, 0}, {screen_->Writer().Width(), screen_->Writer().Height()}};
+  std::vector<LayerShape> shapes;
+  shapes.reserve(layer_stack_.size());
   for (auto layer : layer_stack_) {
-    if (layer->ID() == id) {
-      window_area.size = layer->GetWindow()->Size();
-      window_area.pos = layer->GetPosition();
-      if (area.size.x >= 0 || area.size.y >= 0) {
-        area.pos = area.pos + window_area.pos;
-        window_area = window_area & area;
-      }
-      draw = true;
+    Rectangle<int> area{};
+    if (auto window = layer->GetWindow(); window && layer->Opacity() > 0) {
+      area = Rectangle<int>{layer->GetPosition(), window->Size()} & screen_area;
     }
-    if (draw) {
-      layer->DrawTo(back_buffer_, window_area);
+    shapes.push_back({layer, area, layer->IsOpaque()});
+  }
+
+  const bool unchanged = shapes.size() == visible_shapes_.size() &&
+    std::equal(shapes.begin(), shapes.end(), visible_shapes_.begin(),
+               [](const LayerShape& a, const LayerShape& b) {
+                 return a.layer == b.layer && a.opaque == b.opaque &&
+                        a.area.pos.x == b.area.pos.x && a.area.pos.y == b.area.pos.y &&
+                        a.area.size.x == b.area.size.x && a.area.size.y == b.area.size.y;
+               });
+  if (unchanged) {
+    return;
+  }
+
+  // 上のレイヤーから順に、それより上の不透明なレイヤーが覆う範囲を除いていく
+  visible_.assign(shapes.size(), Region{Region::kUnlimited});
+  Region covered{Region::kUnlimited};
+  for (size_t i = shapes.size(); i-- > 0;) {
+    const auto& area = shapes[i].area;
+    auto& visible = visible_[i];
+    visible.Add(area);
+    for (const auto& c : covered.Rects()) {
+      visible.Subtract(c);
     }
+    if (shapes[i].opaque) {
+      covered.Add(area);
+    }
+  }
+  visible_shapes_ = std::move(shapes);
+}
+
+void LayerManager::Compose(const Rectangle<int>& area) {
+  // 各レイヤーは見えている部分だけを描くので、不透明なレイヤーだけなら各画素を 1 度しか描かない
+  for (size_t i = 0; i < layer_stack_.size(); ++i) {
+    for (const auto& visible : visible_[i].Rects()) {
+      const auto clipped = visible & area;
+      if (IsEmpty(clipped)) {
+        continue;
+      }
+      layer_stack_[i]->DrawTo(back_buffer_, clipped);
+      stats_.composited_pixels += AreaOf(clipped);
+    }
+  }
+  screen_->Copy(area.pos, back_buffer_, area);
+  DrawCursor(area);
+  stats_.presented_pixels += AreaOf(area);
+}
+
+void LayerManager::SetCursor(const std::shared_ptr<Window>& window) {
+  if (cursor_) {
+    const Rectangle<int> old_area{cursor_pos_, cursor_->Size()};
+    screen_->Copy(old_area.pos, back_buffer_, old_area);
+  }
+  cursor_ = window;
+  DrawCursor({cursor_pos_, cursor_ ? cursor_->Size() : Vector2D<int>{0, 0}});
+}
+
+void LayerManager::MoveCursor(Vector2D<int> pos) {
+  if (!cursor_) {
+    cursor_pos_ = pos;
+    return;
+  }
+  const Rectangle<int> old_area{cursor_pos_, cursor_->Size()};
+  cursor_pos_ = pos;
+  screen_->Copy(old_area.pos, back_buffer_, old_area);
+  DrawCursor({cursor_pos_, cursor_->Size()});
+}
+
+void LayerManager::DrawCursor(const Rectangle<int>& area) {
+  if (!cursor_) {
+    return;
+  }
+  const auto clipped = area & Rectangle<int>{cursor_pos_, cursor_->Size()};
+  if (!IsEmpty(clipped)) {
+    cursor_->DrawTo(*screen_, cursor_pos_, clipped);
   }
-  screen_->Copy(window_area.pos, back_buffer_, window_area);
 }
 
 void LayerManager::Move(unsigned int id, Vector2D<int> new_pos) {
+  MoveLayer(FindLayer(id), new_pos);
+}
+
+void LayerManager::MoveRelative(unsigned int id, Vector2D<int> pos_diff) {
   auto layer = FindLayer(id);
+  MoveLayer(layer, layer->GetPosition() + pos_diff);
+}
+
+void LayerManager::MoveLayer(Layer* layer, Vector2D<int> new_pos) {
+  if (BlitMove(layer, new_pos)) {
+    return;
+  }
   const auto window_size = layer->GetWindow()->Size();
   const auto old_pos = layer->GetPosition();
   layer->Move(new_pos);
   Draw({old_pos, window_size});
-  Draw(id);
+  Draw(layer->ID());
 }
 
-void LayerManager::MoveRelative(unsigned int id, Vector2D<int> pos_diff) {
-  auto layer = FindLayer(id);
-  const auto window_size = layer->GetWindow()->Size();
+bool LayerManager::BlitMove(Layer* layer, Vector2D<int> new_pos) {
+  if (layer_stack_.empty() || layer_stack_.back() != layer || !layer->IsOpaque()) {
+    return false;
+  }
+  // FrameBuffer::Move ははみ出しを切り取らないので、移動の前後とも画面に収まる場合に限る
+  const Rectangle<int> screen_area{{0, 0}, {screen_->Writer().Width(), screen_->Writer().Height()}};
   const auto old_pos = layer->GetPosition();
-  layer->MoveRelative(pos_diff);
-  Draw({old_pos, window_size});
-  Draw(id);
+  const Rectangle<int> old_area{old_pos, layer->GetWindow()->Size()};
+  const Rectangle<int> new_area{new_pos, old_area.size};
+  if (!Contains(screen_area, old_area) || !Contains(screen_area, new_area)) {
+    return false;
+  }
+  if (new_pos.x == old_pos.x && new_pos.y == old_pos.y) {
+    return true;
+  }
+
+  layer->Move(new_pos);
+  back_buffer_.Move(new_pos, old_area);
+  stats_.blitted_pixels += AreaOf(old_area);
+
+  // 移した画素のうち、まだ合成し直していなかった部分は移動先でも古いままなので合成し直す
+  std::vector<Rectangle<int>> stale;
+  {
+    LockGuard guard{damage_lock_};
+    for (const auto& d : damage_.Rects()) {
+      const auto s = d & old_area;
+      if (!IsEmpty(s)) {
+        stale.push_back({s.pos + (new_pos - old_pos), s.size});
+      }
+    }
+    present_.Add(new_area);
+  }
+
+  // 覆われなくなった部分だけは下のレイヤーを合成し直す
+  Region exposed{Region::kUnlimited};
+  exposed.Add(old_area);
+  exposed.Subtract(new_area);
+  for (const auto& r : exposed.Rects()) {
+    Invalidate(r);
+  }
+  for (const auto& r : stale) {
+    Invalidate(r);
+  }
+  return true;
 }
 
 void LayerManager::UpDown(unsigned int id, int new_height) {
@@ -195,10 +400,6 @@ LayerManager* layer_manager;
 ActiveLayer::ActiveLayer(LayerManager& manager) : manager_{manager} {
 }
 
-void ActiveLayer::SetMouseLayer(unsigned int mouse_layer) {
-  mouse_layer_ = mouse_layer;
-}
-
 void ActiveLayer::Activate(unsigned int layer_id) {
   if (active_layer_ == layer_id) {
     return;
@@ -214,20 +415,21 @@ void ActiveLayer::Activate(unsigned int layer_id) {
   if (active_layer_ > 0) {
     Layer* layer = manager_.FindLayer(active_layer_);
     layer->GetWindow()->Activate();
-    manager_.UpDown(active_layer_, manager_.GetHeight(mouse_layer_) - 1);
+    manager_.UpDown(active_layer_, std::numeric_limits<int>::max());
     manager_.Draw(active_layer_);
   }
 }
 
 ActiveLayer* active_layer;
 std::map<unsigned int, uint64_t>* layer_task_map;
+Mutex* layer_task_map_mutex;
 
 void InitializeLayer() {
   const auto screen_size = ScreenSize();
 
   auto bgwindow = std::make_shared<Window>(
       screen_size.x, screen_size.y, screen_config.pixel_format);
-  DrawDesktop(*bgwindow->Writer());
+  bgwindow->Paint([](auto surface) { DrawDesktop(surface); });
 
   auto console_window = std::make_shared<Window>(
       Console::kColumns * 8, Console::kRows * 16, screen_config.pixel_format);
@@ -258,6 +460,7 @@ void InitializeLayer() {
   active_layer = new ActiveLayer{*layer_manager};
 
   layer_task_map = new std::map<unsigned int, uint64_t>;
+  layer_task_map_mutex = new Mutex;
 }
 
 void ProcessLayerMessage(const Message& msg) {
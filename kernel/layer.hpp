@@ -13,6 +13,10 @@
 #include "graphics.hpp"
 #include "window.hpp"
 #include "message.hpp"
+#include "region.hpp"
+#include "spinlock.hpp"
+#include "sync.hpp"
+#include "timer.hpp"
 
 /** @brief Layer は 1 つの層を表す。
  *
@@ -42,6 +46,12 @@ class Layer {
   /** @brief レイヤーの位置情報を指定された相対座標へと更新する。再描画はしない。 */
   Layer& MoveRelative(Vector2D<int> pos_diff);
 
+  /** @brief レイヤー全体の不透明度を設定する。255 で不透明、0 で見えなくなる。再描画はしない。 */
+  Layer& SetOpacity(uint8_t opacity);
+  uint8_t Opacity() const { return opacity_; }
+  /** @brief 描くと下のレイヤーを完全に覆うか */
+  bool IsOpaque() const;
+
   /** @brief 指定された描画先にウィンドウの内容を描画する */
   void DrawTo(FrameBuffer& screen, const Rectangle<int>& area) const;
 
@@ -50,11 +60,35 @@ class Layer {
   Vector2D<int> pos_{};
   std::shared_ptr<Window> window_{};
   bool draggable_{false};
+  uint8_t opacity_{255};
+};
+
+/** @brief 合成処理の統計 */
+struct CompositionStats {
+  /** @brief Flush で画面に反映した回数 */
+  uint64_t frames;
+  /** @brief 各レイヤーから裏画面へ描いた画素数の合計 */
+  uint64_t composited_pixels;
+  /** @brief 裏画面から画面へ転送した画素数の合計 */
+  uint64_t presented_pixels;
+  /** @brief ウィンドウの移動で、合成し直さずに裏画面上で移した画素数の合計 */
+  uint64_t blitted_pixels;
 };
 
-/** @brief LayerManager は複数のレイヤーを管理する。 */
+/** @brief LayerManager は複数のレイヤーを管理する。
+ *
+ * Draw や Move はすぐには描画せず、再描画が必要な範囲（ダメージ）を溜めるだけにする。
+ * 溜まった範囲は Flush でまとめて合成し、画面に転送する。
+ * StartFramePacing 以降は、ダメージが溜まると次のフレームの時刻にタイマーが満了するので、
+ * そのメッセージを受け取ったタスクが Flush を呼ぶ。それまでは Draw などの中で直ちに Flush する。
+ */
 class LayerManager {
  public:
+  /** @brief フレームの時刻を知らせるタイマーの値 */
+  static const int kFrameTimerValue = 2;
+  /** @brief フレームの間隔（タイマー割り込みの回数）。60 Hz に最も近い間隔にする。 */
+  static const int kFramePeriod = (kTimerFreq + 30) / 60 > 0 ? (kTimerFreq + 30) / 60 : 1;
+
   /** @brief Draw メソッドなどで描画する際の描画先を設定する。 */
   void SetWriter(FrameBuffer* screen);
   /** @brief 新しいレイヤーを生成して参照を返す。
@@ -63,16 +97,36 @@ class LayerManager {
    */
   Layer& NewLayer();
 
-  /** @brief 現在表示状態にあるレイヤーを描画する。 */
-  void Draw(const Rectangle<int>& area) const;
-  /** @brief 指定したレイヤーに設定されているウィンドウの描画領域内を再描画する。 */
-  void Draw(unsigned int id) const;
-  /** @brief 指定したレイヤーに設定されているウィンドウ内の指定された範囲を再描画する。 */
-  void Draw(unsigned int id, Rectangle<int> area) const;
+  /** @brief 指定された範囲を再描画するよう予約する。 */
+  void Draw(const Rectangle<int>& area);
+  /** @brief 指定したレイヤーに設定されているウィンドウの描画領域内を再描画するよう予約する。 */
+  void Draw(unsigned int id);
+  /** @brief 指定したレイヤーに設定されているウィンドウ内の指定された範囲を再描画するよう予約する。 */
+  void Draw(unsigned int id, Rectangle<int> area);
+  /** @brief 溜まっている再描画範囲を合成し、画面に転送する。 */
+  void Flush();
+  /** @brief どのレイヤーよりも上に重ねて表示するカーソルのウィンドウを設定する。 */
+  void SetCursor(const std::shared_ptr<Window>& window);
+  /** @brief カーソルを移動する。
+   *
+   * 裏画面はカーソルを含まない合成結果なので、カーソルの下の画素の退避先（save-under）として使える。
+   * 移動では元の位置の画素を裏画面から画面へ戻し、新しい位置にカーソルを描くだけで、レイヤーは合成し直さない。
+   * フレームを待たずに直ちに画面へ反映する。
+   */
+  void MoveCursor(Vector2D<int> pos);
+  Vector2D<int> CursorPosition() const { return cursor_pos_; }
+  /** @brief 以後の再描画をフレーム単位にまとめ、フレームの時刻を task_id のタスクへタイマーで知らせる。 */
+  void StartFramePacing(uint64_t task_id);
+  /** @brief 再描画範囲がなくても次のフレームを予約する。割り込みハンドラ以外のどのタスクからも呼べる。
+   *
+   * @return フレームを刻んでいなければ何もせず false を返す。
+   */
+  bool RequestFrame();
+  CompositionStats Stats() const { return stats_; }
 
-  /** @brief レイヤーの位置情報を指定された絶対座標へと更新する。再描画する。 */
+  /** @brief レイヤーの位置情報を指定された絶対座標へと更新する。再描画を予約する。 */
   void Move(unsigned int id, Vector2D<int> new_pos);
-  /** @brief レイヤーの位置情報を指定された相対座標へと更新する。再描画する。 */
+  /** @brief レイヤーの位置情報を指定された相対座標へと更新する。再描画を予約する。 */
   void MoveRelative(unsigned int id, Vector2D<int> pos_diff);
 
   /** @brief レイヤーの高さ方向の位置を指定された位置に移動する。
@@ -94,10 +148,52 @@ class LayerManager {
 
  private:
   FrameBuffer* screen_{nullptr};
-  mutable FrameBuffer back_buffer_{};
+  FrameBuffer back_buffer_{};
   std::vector<std::unique_ptr<Layer>> layers_{};
   std::vector<Layer*> layer_stack_{};
   unsigned int latest_id_{0};
+
+  /** @brief damage_ とフレームの予約状態を保護する。どのタスクからも Draw できるようにするため。 */
+  SpinLock damage_lock_;
+  Region damage_{};
+  /** @brief 裏画面は正しいが、画面へ転送していない範囲 */
+  Region present_{};
+  bool frame_pacing_{false};
+  bool frame_scheduled_{false};
+  uint64_t frame_task_id_{0};
+  unsigned long last_frame_tick_{0};
+  CompositionStats stats_{};
+
+  std::shared_ptr<Window> cursor_{};
+  Vector2D<int> cursor_pos_{};
+  /** @brief 画面上の area の範囲にカーソルを描く。 */
+  void DrawCursor(const Rectangle<int>& area);
+
+  /** @brief layer_stack_ の各レイヤーの、上の不透明なレイヤーに隠されていない部分 */
+  std::vector<Region> visible_{};
+  /** @brief visible_ を求めたときのレイヤーの配置。変わっていたら求め直す。 */
+  struct LayerShape {
+    const Layer* layer;
+    Rectangle<int> area;
+    bool opaque;
+  };
+  std::vector<LayerShape> visible_shapes_{};
+
+  /** @brief レイヤーの移動や重なり順の変更があれば visible_ を求め直す。 */
+  void UpdateVisibleRegions();
+  /** @brief レイヤーを new_pos へ移動し、再描画を予約する。 */
+  void MoveLayer(Layer* layer, Vector2D<int> new_pos);
+  /** @brief 最前面の不透明なレイヤーなら、合成済みの画素を裏画面上で移すことで移動する。
+   *
+   * @return 移動できたら true。条件を満たさなければ何もせず false を返す。
+   */
+  bool BlitMove(Layer* layer, Vector2D<int> new_pos);
+  /** @brief damage_lock_ を保持した状態で次のフレームを予約する。フレームを刻んでいなければ false を返す。 */
+  bool ScheduleFrameLocked();
+  /** @brief area を再描画範囲に加え、必要ならフレームを予約する。 */
+  void Invalidate(const Rectangle<int>& area);
+  /** @brief area を裏画面に合成し、画面に転送する。 */
+  void Compose(const Rectangle<int>& area);
 };
 
 extern LayerManager* layer_manager;
@@ -105,18 +201,18 @@ extern LayerManager* layer_manager;
 class ActiveLayer {
  public:
   ActiveLayer(LayerManager& manager);
-  void SetMouseLayer(unsigned int mouse_layer);
   void Activate(unsigned int layer_id);
   unsigned int GetActive() const { return active_layer_; }
 
  private:
   LayerManager& manager_;
   unsigned int active_layer_{0};
-  unsigned int mouse_layer_{0};
 };
 
 extern ActiveLayer* active_layer;
 extern std::map<unsigned int, uint64_t>* layer_task_map;
+/** @brief layer_task_map を保護する */
+extern Mutex* layer_task_map_mutex;
 
 void InitializeLayer();
 void ProcessLayerMessage(const Message& msg);
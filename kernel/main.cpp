@@ -32,10 +32,21 @@
 #include "message.hpp"
 #include "timer.hpp"
 #include "acpi.hpp"
+#include "ioapic.hpp"
+#include "hpet.hpp"
 #include "keyboard.hpp"
 #include "task.hpp"
+#include "task_stack.hpp"
 #include "terminal.hpp"
 #include "fat.hpp"
+#include "fpu.hpp"
+#include "futex.hpp"
+#include "workqueue.hpp"
+#include "threadpool.hpp"
+#include "coro.hpp"
+#include "shared_buffer.hpp"
+#include "serial.hpp"
+#include "trace.hpp"
 
 int printk(const char* format, ...) {
   va_list ap;
@@ -135,33 +146,24 @@ void TaskB(uint64_t task_id, int64_t data) {
   char str[128];
   int count = 0;
 
-  __asm__("cli");
   Task& task = task_manager->CurrentTask();
-  __asm__("sti");
 
   while (true) {
     count++;
     sprintf(str, "%010d", count);
-    FillRectangle(*task_b_window->InnerWriter(), {20, 4}, {8 * 10, 16}, {0xc6, 0xc6, 0xc6});
-    WriteString(*task_b_window->InnerWriter(), {20, 4}, str, {0, 0, 0});
+    task_b_window->PaintInner([&](auto surface) {
+      FillRectangle(surface, {20, 4}, {8 * 10, 16}, {0xc6, 0xc6, 0xc6});
+      WriteString(surface, {20, 4}, str, {0, 0, 0});
+    });
 
     Message msg{Message::kLayer, task_id};
     msg.arg.layer.layer_id = task_b_window_layer_id;
     msg.arg.layer.op = LayerOperation::Draw;
-    __asm__("cli");
     task_manager->SendMessage(1, msg);
-    __asm__("sti");
 
     while (true) {
-      __asm__("cli");
-      auto msg = task.ReceiveMessage();
-      if (!msg) {
-        task.Sleep();
-        __asm__("sti");
-        continue;
-      }
-
-      if (msg->type == Message::kLayerFinish) {
+      auto msg = task.WaitMessage();
+      if (msg.type == Message::kLayerFinish) {
         break;
       }
     }
@@ -183,9 +185,12 @@ extern "C" void KernelMainNewStack(
   printk("Welcome to SazaOS!\n");
   SetLogLevel(kWarn);
 
+  InitializeSerial();
   InitializeSegmentation();
   InitializePaging();
   InitializeMemoryManager(memory_map);
+  InitializeStackAllocator();
+  InitializeTSS();
   InitializeInterrupt();
 
   fat::Initialize(volume_image);
@@ -201,6 +206,8 @@ extern "C" void KernelMainNewStack(
   layer_manager->UpDown(task_b_window_layer_id, std::numeric_limits<int>::max());
 
   acpi::Initialize(acpi_table);
+  ioapic::Initialize();
+  InitializeHPET();
   InitializeLAPICTimer();
 
   const int kTextboxCursorTimer = 1;
@@ -208,8 +215,16 @@ extern "C" void KernelMainNewStack(
   timer_manager->AddTimer(Timer{kTimer05Sec, kTextboxCursorTimer});
   bool textbox_cursor_visible = false;
 
+  InitializeFPU();
   InitializeTask();
+  InitializeFutex();
+  InitializeTrace();
+  InitializeSharedBuffer();
+  InitializeWorkQueue();
+  coro::InitializeExecutor();
+  InitializeThreadPool();
   Task& main_task = task_manager->CurrentTask();
+  layer_manager->StartFramePacing(main_task.ID());
   const uint64_t taskb_id = task_manager->NewTask()
     .InitContext(TaskB, 45)
     .Wakeup()
@@ -224,77 +239,88 @@ extern "C" void KernelMainNewStack(
   InitializeMouse();
 
   char str[128];
+  // kLayer を送ってきて、それを反映するフレームの Flush を待っているタスク
+  std::vector<uint64_t> layer_finish_waiters;
 
   while (true) {
-    __asm__("cli");
     const auto tick = timer_manager->CurrentTick();
-    __asm__("sti");
 
     sprintf(str, "%010lu", tick);
-    FillRectangle(*main_window->InnerWriter(), {20, 4}, {8 * 10, 16}, {0xc6, 0xc6, 0xc6});
-    WriteString(*main_window->InnerWriter(), {20, 4}, str, {0, 0, 0});
+    main_window->PaintInner([&](auto surface) {
+      FillRectangle(surface, {20, 4}, {8 * 10, 16}, {0xc6, 0xc6, 0xc6});
+      WriteString(surface, {20, 4}, str, {0, 0, 0});
+    });
     layer_manager->Draw(main_window_layer_id);
 
-    __asm__("cli");
-    auto msg = main_task.ReceiveMessage();
-    if (!msg) {
-      main_task.Sleep();
-      __asm__("sti");
-      continue;
+    auto msg = main_task.WaitMessage();
+    // フレームの時刻が来ただけなら、カウンタを描き直して次のフレームを予約しないよう続けて待つ
+    while (msg.type == Message::kTimerTimeout &&
+           msg.arg.timer.value == LayerManager::kFrameTimerValue) {
+      ProcessMouseEvents();
+      layer_manager->Flush();
+      // 合成が送り手のバッファを読み終えたので、描き直してよいと知らせる
+      for (const uint64_t waiter : layer_finish_waiters) {
+        task_manager->SendMessage(waiter, Message{Message::kLayerFinish});
+      }
+      layer_finish_waiters.clear();
+      // Flush がフレームの予約を解く前に届いた報告は、新たなフレームを予約していないのでここで処理する
+      ProcessMouseEvents();
+      msg = main_task.WaitMessage();
     }
 
-    __asm__("sti");
-    switch (msg->type) {
-      case Message::kInterruptXHCI:
-        usb::xhci::ProcessEvents();
+    switch (msg.type) {
+      case Message::kMouseMove:
+        ProcessMouseEvents();
         break;
       case Message::kTimerTimeout:
-        if (msg->arg.timer.value == kTextboxCursorTimer) {
-          __asm__("cli");
+        if (msg.arg.timer.value == kTextboxCursorTimer) {
           timer_manager->AddTimer(
-              Timer{msg->arg.timer.timeout + kTimer05Sec, kTextboxCursorTimer});
-          __asm__("sti");
+              Timer{msg.arg.timer.timeout + kTimer05Sec, kTextboxCursorTimer});
           textbox_cursor_visible = !textbox_cursor_visible;
           DrawTextCursor(textbox_cursor_visible);
           layer_manager->Draw(text_window_layer_id);
 
-          __asm__("cli");
-          task_manager->SendMessage(task_terminal_id, *msg);
-          __asm__("sti");
+          task_manager->SendMessage(task_terminal_id, msg);
         }
         break;
       case Message::kKeyPush:
         if (auto act = active_layer->GetActive(); act == text_window_layer_id) {
-          InputTextWindow(msg->arg.keyboard.ascii);
+          InputTextWindow(msg.arg.keyboard.ascii);
         } else if (act == task_b_window_layer_id) {
-          if (msg->arg.keyboard.ascii == 's') {
+          if (msg.arg.keyboard.ascii == 's') {
             printk("sleep TaskB: %s\n", task_manager->Sleep(taskb_id).Name());
-          } else if (msg->arg.keyboard.ascii == 'w') {
+          } else if (msg.arg.keyboard.ascii == 'w') {
             printk("wakeup TaskB: %s\n", task_manager->Wakeup(taskb_id).Name());
           }
         } else {
-          __asm__("cli");
-          auto task_it = layer_task_map->find(act);
-          __asm__("sti");
-          if (task_it != layer_task_map->end()) {
-            __asm__("cli");
-            task_manager->SendMessage(task_it->second, *msg);
-            __asm__("sti");
+          std::optional<uint64_t> task_id;
+          layer_task_map_mutex->Lock();
+          if (auto it = layer_task_map->find(act); it != layer_task_map->end()) {
+            task_id = it->second;
+          }
+          layer_task_map_mutex->Unlock();
+
+          if (task_id) {
+            task_manager->SendMessage(*task_id, msg);
           } else {
             printk("key push not handled: keycode %02x, ascii %02x\n",
-                msg->arg.keyboard.keycode,
-                msg->arg.keyboard.ascii);
+                msg.arg.keyboard.keycode,
+                msg.arg.keyboard.ascii);
           }
         }
         break;
       case Message::kLayer:
-        ProcessLayerMessage(*msg);
-        __asm__("cli");
-        task_manager->SendMessage(msg->src_task, Message{Message::kLayerFinish});
-        __asm__("sti");
+        ProcessLayerMessage(msg);
+        // 合成は次のフレームまで遅れるので、その Flush が終わってから返事をする
+        if (layer_manager->RequestFrame()) {
+          layer_finish_waiters.push_back(msg.src_task);
+        } else {
+          task_manager->SendMessage(msg.src_task, Message{Message::kLayerFinish});
+        }
         break;
       default:
-        Log(kError, "Unknown message type: %d\n", msg->type);
+        Log(kError, "Unknown message type: %d\n", msg.type);
+        DiscardMessage(msg);
     }
   }
 }
@@ -72,9 +72,10 @@ extern "C" caddr_t program_break, program_break_end;
 
 namespace {
   char memory_manager_buf[sizeof(BitmapMemoryManager)];
-  BitmapMemoryManager* memory_manager;
 }
 
+BitmapMemoryManager* memory_manager;
+
 Error InitializeHeap(BitmapMemoryManager& memory_manager) {
   const int kHeapFrames = 64 * 512;
   const auto heap_start = memory_manager.Allocate(kHeapFrames);
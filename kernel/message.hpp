@@ -1,16 +1,21 @@
 #pragma once
 
+class SharedBuffer;
+
 enum class LayerOperation {
   Move, MoveRelative, Draw, DrawArea,
 };
 
 struct Message {
   enum Type {
-    kInterruptXHCI,
     kTimerTimeout,
     kKeyPush,
+    kMouseMove,
+    /** @brief レイヤーの操作を依頼する。合成はすぐには行われず、次のフレームでまとめて行われる。 */
     kLayer,
+    /** @brief kLayer の内容が画面に反映された。以後は送り手がバッファを描き直しても合成と競合しない。 */
     kLayerFinish,
+    kSharedBuffer,
   } type;
 
   uint64_t src_task;
@@ -33,5 +38,11 @@ struct Message {
       int x, y;
       int w, h;
     } layer;
+
+    /** @brief 参照 1 つを受信側に渡す。受信側は SharedBufferRef::Adopt で引き取る。 */
+    struct {
+      SharedBuffer* buffer;
+      uint32_t tag;
+    } shared_buffer;
   } arg;
 };
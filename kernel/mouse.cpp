@@ -1,9 +1,11 @@
 #include "mouse.hpp"
 
-#include <limits>
+#include <algorithm>
 #include <memory>
 #include "graphics.hpp"
 #include "layer.hpp"
+#include "spinlock.hpp"
+#include "task.hpp"
 #include "usb/classdriver/mouse.hpp"
 
 namespace {
@@ -36,28 +38,27 @@ namespace {
 }
 
 void DrawMouseCursor(PixelWriter* pixel_writer, Vector2D<int> position) {
+  PixelColor row[kMouseCursorWidth];
   for (int dy = 0; dy < kMouseCursorHeight; ++dy) {
     for (int dx = 0; dx < kMouseCursorWidth; ++dx) {
       if (mouse_cursor_shape[dy][dx] == '@') {
-        pixel_writer->Write(position + Vector2D<int>{dx, dy}, {0, 0, 0});
+        row[dx] = {0, 0, 0};
       } else if (mouse_cursor_shape[dy][dx] == '.') {
-        pixel_writer->Write(position + Vector2D<int>{dx, dy}, {255, 255, 255});
+        row[dx] = {255, 255, 255};
       } else {
-        pixel_writer->Write(position + Vector2D<int>{dx, dy}, kMouseTransparentColor);
+        row[dx] = kMouseTransparentColor;
       }
     }
+    pixel_writer->WriteRow(position + Vector2D<int>{0, dy}, row, kMouseCursorWidth);
   }
 }
 
-Mouse::Mouse(unsigned int layer_id) : layer_id_{layer_id} {
-}
-
 void Mouse::SetPosition(Vector2D<int> position) {
   position_ = position;
-  layer_manager->Move(layer_id_, position_);
+  layer_manager->MoveCursor(position_);
 }
 
-void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
+void Mouse::OnInterrupt(uint8_t buttons, int displacement_x, int displacement_y) {
   const auto oldpos = position_;
   auto newpos = position_ + Vector2D<int>{displacement_x, displacement_y};
   newpos = ElementMin(newpos, ScreenSize() + Vector2D<int>{-1, -1});
@@ -65,12 +66,12 @@ void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacem
 
   const auto posdiff = position_ - oldpos;
 
-  layer_manager->Move(layer_id_, position_);
+  layer_manager->MoveCursor(position_);
 
   const bool previous_left_pressed = (previous_buttons_ & 0x01);
   const bool left_pressed = (buttons & 0x01);
   if (!previous_left_pressed && left_pressed) {
-    auto layer = layer_manager->FindLayerByPosition(position_, layer_id_);
+    auto layer = layer_manager->FindLayerByPosition(position_, 0);
     if (layer && layer->IsDraggable()) {
       drag_layer_id_ = layer->ID();
       active_layer->Activate(layer->ID());
@@ -88,24 +89,97 @@ void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacem
   previous_buttons_ = buttons;
 }
 
+namespace {
+  std::shared_ptr<Mouse> mouse;
+
+  /** @brief 移動量を合計した 1 回分のマウスの報告 */
+  struct MouseEvent {
+    uint8_t buttons;
+    int dx, dy;
+    /** @brief 直前のイベントからボタンの状態が変わったか */
+    bool transition;
+  };
+
+  /** @brief ドライバから届いた報告を、メインタスクが処理するまで溜めておく。
+   *
+   * ボタンの状態が変わらない間の移動量は 1 つのイベントに合計する。
+   * ボタンの状態が変わった報告は新しいイベントとし、それ以降の移動をそこへ合計しないので、
+   * ドラッグの開始と終了の位置と順序は保たれる。
+   */
+  class MouseEventQueue {
+   public:
+    static const int kCapacity = 16;
+
+    /** @return 空だった（メインタスクへの通知が必要な）なら true */
+    bool Push(uint8_t buttons, int dx, int dy) {
+      LockGuard guard{lock_};
+      const bool was_empty = count_ == 0;
+      const bool transition = buttons != last_buttons_;
+      last_buttons_ = buttons;
+      if (count_ > 0 && !transition && !events_[count_ - 1].transition) {
+        events_[count_ - 1].dx += dx;
+        events_[count_ - 1].dy += dy;
+      } else if (count_ < kCapacity) {
+        events_[count_++] = {buttons, dx, dy, transition};
+      } else {
+        // 満杯なら最後のイベントにまとめる。途中のボタンの変化は失われる。
+        auto& last = events_[count_ - 1];
+        last.buttons = buttons;
+        last.dx += dx;
+        last.dy += dy;
+      }
+      return was_empty;
+    }
+
+    /** @brief 溜まっているイベントを out に移し、その数を返す。 */
+    int Drain(MouseEvent (&out)[kCapacity]) {
+      LockGuard guard{lock_};
+      const int n = count_;
+      std::copy(events_, events_ + n, out);
+      count_ = 0;
+      return n;
+    }
+
+   private:
+    SpinLock lock_;
+    MouseEvent events_[kCapacity];
+    int count_{0};
+    uint8_t last_buttons_{0};
+  };
+
+  MouseEventQueue* mouse_events;
+}
+
 void InitializeMouse() {
   auto mouse_window = std::make_shared<Window>(
       kMouseCursorWidth, kMouseCursorHeight, screen_config.pixel_format);
   mouse_window->SetTransparentColor(kMouseTransparentColor);
   DrawMouseCursor(mouse_window->Writer(), {0, 0});
 
-  auto mouse_layer_id = layer_manager->NewLayer()
-  .SetWindow(mouse_window)
-  .ID();
+  // カーソルはレイヤーではなく、すべてのレイヤーの上に重ねる専用の描画で扱う
+  layer_manager->SetCursor(mouse_window);
 
-  auto mouse = std::make_shared<Mouse>(mouse_layer_id);
+  mouse = std::make_shared<Mouse>();
   mouse->SetPosition({200, 200});
-  layer_manager->UpDown(mouse->LayerID(), std::numeric_limits<int>::max());
 
+  // ドライバはワーカータスクで動くので、レイヤーの操作はメインタスクに任せる。
+  // 報告は溜めておき、次のフレームでまとめて処理する。
+  mouse_events = new MouseEventQueue;
   usb::HIDMouseDriver::default_observer =
-    [mouse](uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
-      mouse->OnInterrupt(buttons, displacement_x, displacement_y);
+    [](uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
+      if (!mouse_events->Push(buttons, displacement_x, displacement_y)) {
+        return;
+      }
+      if (!layer_manager->RequestFrame()) {
+        task_manager->SendMessage(1, Message{Message::kMouseMove});
+      }
     };
-  
-  active_layer->SetMouseLayer(mouse_layer_id);
+}
+
+void ProcessMouseEvents() {
+  MouseEvent events[MouseEventQueue::kCapacity];
+  const int n = mouse_events->Drain(events);
+  for (int i = 0; i < n; ++i) {
+    mouse->OnInterrupt(events[i].buttons, events[i].dx, events[i].dy);
+  }
 }
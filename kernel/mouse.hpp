@@ -9,6 +9,7 @@
 #include <memory>
 
 #include "graphics.hpp"
+#include "message.hpp"
 
 const int kMouseCursorWidth = 15;
 const int kMouseCursorHeight = 24;
@@ -18,15 +19,12 @@ void DrawMouseCursor(PixelWriter* pixel_writer, Vector2D<int> position);
 
 class Mouse {
  public:
-  Mouse(unsigned int layer_id);
-  void OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacement_y);
+  void OnInterrupt(uint8_t buttons, int displacement_x, int displacement_y);
 
-  unsigned int LayerID() const { return layer_id_; }
   void SetPosition(Vector2D<int> position);
   Vector2D<int> Position() const { return position_; }
 
  private:
-  unsigned int layer_id_;
   Vector2D<int> position_{};
 
   unsigned int drag_layer_id_{0};
@@ -34,3 +32,8 @@ class Mouse {
 };
 
 void InitializeMouse();
+/** @brief ドライバから届いて溜まっているマウスの報告をまとめて処理する。
+ *
+ * フレームの時刻と kMouseMove メッセージを受け取ったときにメインタスクから呼ぶ。
+ */
+void ProcessMouseEvents();
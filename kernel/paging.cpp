@@ -4,6 +4,7 @@
 #include <cstdint>
 
 #include "asmfunc.h"
+#include "memory_manager.hpp"
 
 namespace {
   const uint64_t kPageSize4K = 4096;
@@ -30,3 +31,48 @@ void SetupIdentityPageTable() {
 void InitializePaging() {
   SetupIdentityPageTable();
 }
+
+namespace {
+  /** @brief 2MiB ページのエントリを，同じ範囲を指す 4KiB ページのページテーブルに置き換える． */
+  Error SplitLargePage(uint64_t& pd_entry) {
+    const auto frame = memory_manager->Allocate(1);
+    if (frame.error) {
+      return frame.error;
+    }
+
+    auto page_table = reinterpret_cast<uint64_t*>(frame.value.Frame());
+    const uint64_t base = pd_entry & ~(kPageSize2M - 1);
+    for (int i = 0; i < 512; i++) {
+      page_table[i] = (base + i * kPageSize4K) | 0x003;
+    }
+
+    pd_entry = reinterpret_cast<uint64_t>(page_table) | 0x003;
+    SetCR3(GetCR3()); // 2MiB ページの TLB エントリをすべて破棄する
+    return MAKE_ERROR(Error::kSuccess);
+  }
+}
+
+Error SetPagePresent(uint64_t addr, bool present) {
+  const uint64_t i_pdpt = addr / kPageSize1G;
+  const uint64_t i_pd = (addr / kPageSize2M) % 512;
+  if (i_pdpt >= page_directory.size()) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  auto& pd_entry = page_directory[i_pdpt][i_pd];
+  if (pd_entry & 0x080) {
+    if (auto err = SplitLargePage(pd_entry)) {
+      return err;
+    }
+  }
+
+  auto page_table = reinterpret_cast<uint64_t*>(pd_entry & ~static_cast<uint64_t>(0xfff));
+  auto& pt_entry = page_table[(addr / kPageSize4K) % 512];
+  if (present) {
+    pt_entry |= 0x001;
+  } else {
+    pt_entry &= ~static_cast<uint64_t>(0x001);
+  }
+  InvalidateTLB(addr);
+  return MAKE_ERROR(Error::kSuccess);
+}
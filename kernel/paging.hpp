@@ -1,6 +1,9 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
 
 /** @brief 静的に確保するページディレクトリの個数
  *
@@ -16,3 +19,10 @@ const size_t kPageDirectoryCount = 64;
 void SetupIdentityPageTable();
 
 void InitializePaging();
+
+/** @brief addr を含む 4KiB ページの present ビットを設定する．
+ *
+ * addr を含む 2MiB ページは 4KiB ページのページテーブルに分割される．
+ * ガードページのように，一部のページだけを外すために使う．
+ */
+Error SetPagePresent(uint64_t addr, bool present);
@@ -0,0 +1,136 @@
+#include "region.hpp"
+
+#include <algorithm>
+
+namespace {
+  bool Overlaps(const Rectangle<int>& a, const Rectangle<int>& b) {
+    return a.pos.x < b.pos.x + b.size.x && b.pos.x < a.pos.x + a.size.x &&
+           a.pos.y < b.pos.y + b.size.y && b.pos.y < a.pos.y + a.size.y;
+  }
+
+  Rectangle<int> BoundingBox(const Rectangle<int>& a, const Rectangle<int>& b) {
+    const auto pos = ElementMin(a.pos, b.pos);
+    const auto end = ElementMax(a.pos + a.size, b.pos + b.size);
+    return {pos, end - pos};
+  }
+
+  /** @brief r から e と重なる部分を除いた残りを、最大 4 つの矩形として out に加える。 */
+  void SubtractRect(const Rectangle<int>& r, const Rectangle<int>& e,
+                    std::vector<Rectangle<int>>& out) {
+    const int r_end_x = r.pos.x + r.size.x, r_end_y = r.pos.y + r.size.y;
+    const int top = std::max(r.pos.y, e.pos.y);
+    const int bottom = std::min(r_end_y, e.pos.y + e.size.y);
+    const int left = std::max(r.pos.x, e.pos.x);
+    const int right = std::min(r_end_x, e.pos.x + e.size.x);
+
+    if (r.pos.y < top) {
+      out.push_back({r.pos, {r.size.x, top - r.pos.y}});
+    }
+    if (bottom < r_end_y) {
+      out.push_back({{r.pos.x, bottom}, {r.size.x, r_end_y - bottom}});
+    }
+    if (r.pos.x < left) {
+      out.push_back({{r.pos.x, top}, {left - r.pos.x, bottom - top}});
+    }
+    if (right < r_end_x) {
+      out.push_back({{right, top}, {r_end_x - right, bottom - top}});
+    }
+  }
+}
+
+void Region::Add(const Rectangle<int>& r) {
+  if (IsEmpty(r)) {
+    return;
+  }
+  AddDisjoint(r);
+  while (rects_.size() > max_rects_) {
+    MergeCheapestPair();
+  }
+}
+
+void Region::Subtract(const Rectangle<int>& r) {
+  if (IsEmpty(r)) {
+    return;
+  }
+  std::vector<Rectangle<int>> rest;
+  for (const auto& e : rects_) {
+    if (Overlaps(e, r)) {
+      SubtractRect(e, r, rest);
+    } else {
+      rest.push_back(e);
+    }
+  }
+  rects_.swap(rest);
+  while (rects_.size() > max_rects_) {
+    MergeCheapestPair();
+  }
+}
+
+uint64_t Region::Area() const {
+  uint64_t area = 0;
+  for (const auto& r : rects_) {
+    area += AreaOf(r);
+  }
+  return area;
+}
+
+void Region::AddDisjoint(const Rectangle<int>& r) {
+  for (const auto& e : rects_) {
+    if (Contains(e, r)) {
+      return;
+    }
+  }
+  // r に飲み込まれる矩形は捨て、r を分割せずに済むようにする
+  rects_.erase(std::remove_if(rects_.begin(), rects_.end(),
+                              [&r](const auto& e) { return Contains(r, e); }),
+               rects_.end());
+
+  std::vector<Rectangle<int>> pieces{r}, rest;
+  for (const auto& e : rects_) {
+    rest.clear();
+    for (const auto& p : pieces) {
+      if (Overlaps(p, e)) {
+        SubtractRect(p, e, rest);
+      } else {
+        rest.push_back(p);
+      }
+    }
+    pieces.swap(rest);
+  }
+  rects_.insert(rects_.end(), pieces.begin(), pieces.end());
+}
+
+void Region::MergeCheapestPair() {
+  size_t best_i = 0, best_j = 1;
+  uint64_t best_cost = UINT64_MAX;
+  for (size_t i = 0; i < rects_.size(); ++i) {
+    for (size_t j = i + 1; j < rects_.size(); ++j) {
+      const uint64_t cost = AreaOf(BoundingBox(rects_[i], rects_[j]))
+        - AreaOf(rects_[i]) - AreaOf(rects_[j]);
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_i = i;
+        best_j = j;
+      }
+    }
+  }
+
+  auto merged = BoundingBox(rects_[best_i], rects_[best_j]);
+  rects_.erase(rects_.begin() + best_j);
+  rects_.erase(rects_.begin() + best_i);
+
+  // 外接矩形と重なる矩形も取り込み、矩形の数が必ず減るようにする
+  bool grown = true;
+  while (grown) {
+    grown = false;
+    for (auto it = rects_.begin(); it != rects_.end(); ++it) {
+      if (Overlaps(merged, *it)) {
+        merged = BoundingBox(merged, *it);
+        rects_.erase(it);
+        grown = true;
+        break;
+      }
+    }
+  }
+  rects_.push_back(merged);
+}
@@ -0,0 +1,59 @@
+/**
+ * @file region.hpp
+ *
+ * 再描画が必要な範囲を、互いに重ならない少数の矩形の集まりとして溜める。
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "graphics.hpp"
+
+/** @brief 互いに重ならない矩形の集まり。
+ *
+ * 同じ画素を何度追加しても 1 度だけ数えられる。
+ * 矩形が max_rects 個を超えたら、面積の増え方が最も小さい 2 つを外接矩形にまとめる。
+ * まとめると元より広い範囲を表すことになるので、正確な範囲が要るなら kUnlimited を指定する。
+ */
+class Region {
+ public:
+  static const size_t kMaxRects = 16;
+  static const size_t kUnlimited = SIZE_MAX;
+
+  explicit Region(size_t max_rects = kMaxRects) : max_rects_{max_rects} {}
+
+  /** @brief r を範囲に加える。大きさが 0 以下の矩形は無視する。 */
+  void Add(const Rectangle<int>& r);
+  /** @brief r と重なる部分を範囲から取り除く。 */
+  void Subtract(const Rectangle<int>& r);
+  void Clear() { rects_.clear(); }
+  bool Empty() const { return rects_.empty(); }
+  const std::vector<Rectangle<int>>& Rects() const { return rects_; }
+  /** @brief 範囲に含まれる画素数 */
+  uint64_t Area() const;
+
+ private:
+  size_t max_rects_;
+  std::vector<Rectangle<int>> rects_{};
+
+  /** @brief r のうち既存の矩形に覆われていない部分を、重ならないように加える。 */
+  void AddDisjoint(const Rectangle<int>& r);
+  /** @brief まとめても面積が最も増えない 2 つの矩形を外接矩形にまとめる。 */
+  void MergeCheapestPair();
+};
+
+inline bool IsEmpty(const Rectangle<int>& r) {
+  return r.size.x <= 0 || r.size.y <= 0;
+}
+
+inline uint64_t AreaOf(const Rectangle<int>& r) {
+  return IsEmpty(r) ? 0 : static_cast<uint64_t>(r.size.x) * r.size.y;
+}
+
+inline bool Contains(const Rectangle<int>& outer, const Rectangle<int>& inner) {
+  return outer.pos.x <= inner.pos.x && outer.pos.y <= inner.pos.y &&
+         inner.pos.x + inner.size.x <= outer.pos.x + outer.size.x &&
+         inner.pos.y + inner.size.y <= outer.pos.y + outer.size.y;
+}
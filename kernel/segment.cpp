@@ -3,9 +3,27 @@
 #include <array>
 
 #include "asmfunc.h"
+#include "logger.hpp"
+#include "task_stack.hpp"
 
 namespace {
-  std::array<SegmentDescriptor, 3> gdt;
+  std::array<SegmentDescriptor, 5> gdt;
+  TaskStateSegment tss;
+
+  /** @brief スタックが溢れたタスクのスタックを使わずに例外を処理するためのスタックの大きさ */
+  const size_t kExceptionStackBytes = 8 * 4096;
+
+  void SetSystemSegment(SegmentDescriptor& desc,
+                        DescriptorType type,
+                        unsigned int descriptor_privilege_level,
+                        uint64_t base,
+                        uint32_t limit) {
+    SetCodeSegment(desc, type, descriptor_privilege_level, base & 0xffffffffu, limit);
+    desc.bits.system_segment = 0;
+    desc.bits.long_mode = 0;
+    desc.bits.granularity = 0;
+    (&desc)[1].data = base >> 32; // 上位 8 バイトはベースアドレスの上位 32 ビット
+  }
 }
 
 void SetCodeSegment(SegmentDescriptor& desc,
@@ -55,3 +73,19 @@ void InitializeSegmentation() {
   SetDSAll(kKernelDS);
   SetCSSS(kKernelCS, kKernelSS);
 }
+
+void InitializeTSS() {
+  const auto stack = stack_allocator->Allocate(kExceptionStackBytes);
+  if (stack.error) {
+    Log(kError, "failed to allocate an exception stack: %s\n", stack.error.Name());
+    exit(1);
+  }
+
+  memset(&tss, 0, sizeof(tss));
+  tss.ist[kISTForException - 1] = stack.value.Top() & ~static_cast<uint64_t>(0xf);
+  tss.iomap_base = sizeof(tss);
+
+  SetSystemSegment(gdt[kTSS >> 3], DescriptorType::kTSSAvailable, 0,
+                   reinterpret_cast<uint64_t>(&tss), sizeof(tss) - 1);
+  LoadTR(kTSS);
+}
@@ -37,6 +37,25 @@ void SetDataSegment(SegmentDescriptor& desc,
 const uint16_t kKernelCS = 1 << 3;
 const uint16_t kKernelSS = 2 << 3;
 const uint16_t kKernelDS = 0;
+/** @brief TSS ディスクリプタのセレクタ。64 ビットモードの TSS ディスクリプタは GDT の 2 要素を使う。 */
+const uint16_t kTSS = 3 << 3;
+
+/** @brief 64 ビットモードのタスクステートセグメント */
+struct TaskStateSegment {
+  uint32_t reserved1;
+  uint64_t rsp[3];
+  uint64_t reserved2;
+  /** @brief IDT で IST 番号 n を指定した割り込みは ist[n - 1] のスタックで処理される */
+  uint64_t ist[7];
+  uint64_t reserved3;
+  uint16_t reserved4;
+  uint16_t iomap_base;
+} __attribute__((packed));
+
+/** @brief 例外処理用のスタックを指す IST の番号 */
+const int kISTForException = 1;
 
 void SetupSegments();
 void InitializeSegmentation();
+/** @brief TSS を設定し，例外処理用のスタックを IST に登録する．StackAllocator の初期化後に呼ぶ． */
+void InitializeTSS();
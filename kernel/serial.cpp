@@ -0,0 +1,45 @@
+#include "serial.hpp"
+
+#include <cstdint>
+
+#include "asmfunc.h"
+
+namespace {
+  const uint16_t kCOM1 = 0x3f8;
+  const uint16_t kLineStatus = kCOM1 + 5;
+  const uint8_t kTransmitterEmpty = 0x20;
+
+  bool serial_available = false;
+
+  void SerialPutc(char c) {
+    while ((IoIn8(kLineStatus) & kTransmitterEmpty) == 0) {
+      __asm__ volatile("pause");
+    }
+    IoOut8(kCOM1, c);
+  }
+}
+
+void InitializeSerial() {
+  IoOut8(kCOM1 + 1, 0x00); // 割り込みを使わない
+  IoOut8(kCOM1 + 3, 0x80); // DLAB = 1 で分周比を設定する
+  IoOut8(kCOM1 + 0, 0x01); // 115200 / 1 bps
+  IoOut8(kCOM1 + 1, 0x00);
+  IoOut8(kCOM1 + 3, 0x03); // 8 ビット，パリティなし，ストップビット 1
+  IoOut8(kCOM1 + 2, 0xc7); // FIFO を有効化してクリアする
+  IoOut8(kCOM1 + 4, 0x03); // DTR, RTS
+
+  // ポートが存在しなければ 0xff が読めるので，以降の出力を捨てる
+  serial_available = IoIn8(kLineStatus) != 0xff;
+}
+
+void SerialWrite(const char* s) {
+  if (!serial_available) {
+    return;
+  }
+  for (; *s; ++s) {
+    if (*s == '\n') {
+      SerialPutc('\r');
+    }
+    SerialPutc(*s);
+  }
+}
@@ -0,0 +1,12 @@
+/**
+ * @file serial.hpp
+ *
+ * シリアルポート (COM1) への出力。画面を使わずにホストへログやトレースを送るために使う。
+ */
+
+#pragma once
+
+/** @brief COM1 を 115200 bps, 8N1 に設定する。 */
+void InitializeSerial();
+/** @brief 文字列を COM1 に送る。送信バッファが空くまでポーリングで待つ。 */
+void SerialWrite(const char* s);
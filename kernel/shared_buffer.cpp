@@ -0,0 +1,104 @@
+#include "shared_buffer.hpp"
+
+#include <array>
+#include <new>
+
+#include "spinlock.hpp"
+
+/** @brief 大きさのクラスごとに空きバッファを溜めておくプール */
+class SharedBufferPool {
+ public:
+  /** @brief 最小のクラスの容量。クラスが 1 つ上がるごとに倍になる。 */
+  static const size_t kMinBytes = 512;
+  static const int kNumClasses = 8; // 512 B 〜 64 KiB
+  /** @brief クラスごとに溜めておく空きバッファの上限 */
+  static const int kMaxFreePerClass = 16;
+
+  SharedBuffer* Allocate(size_t bytes) {
+    int size_class = 0;
+    while (size_class < kNumClasses && (kMinBytes << size_class) < bytes) {
+      ++size_class;
+    }
+    if (size_class == kNumClasses) {
+      // 大きすぎるものはプールせず、ちょうどの大きさで確保する
+      return New(bytes, -1);
+    }
+
+    {
+      LockGuard guard{lock_};
+      auto& cls = classes_[size_class];
+      if (auto buf = cls.free) {
+        cls.free = buf->next_free_;
+        cls.num_free--;
+        buf->refs_.store(1, std::memory_order_relaxed);
+        buf->size_ = 0;
+        return buf;
+      }
+    }
+    return New(kMinBytes << size_class, size_class);
+  }
+
+  void Free(SharedBuffer* buf) {
+    if (buf->size_class_ >= 0) {
+      LockGuard guard{lock_};
+      auto& cls = classes_[buf->size_class_];
+      if (cls.num_free < kMaxFreePerClass) {
+        buf->next_free_ = cls.free;
+        cls.free = buf;
+        cls.num_free++;
+        return;
+      }
+    }
+    buf->~SharedBuffer();
+    operator delete(buf);
+  }
+
+ private:
+  struct SizeClass {
+    SharedBuffer* free{nullptr};
+    int num_free{0};
+  };
+
+  SpinLock lock_;
+  std::array<SizeClass, kNumClasses> classes_{};
+
+  static SharedBuffer* New(size_t capacity, int size_class) {
+    void* p = operator new(sizeof(SharedBuffer) + capacity, std::nothrow);
+    if (!p) {
+      return nullptr;
+    }
+    return new(p) SharedBuffer{capacity, size_class};
+  }
+};
+
+namespace {
+  SharedBufferPool* pool;
+}
+
+void SharedBufferRef::Reset() {
+  if (buf_ && buf_->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    pool->Free(buf_);
+  }
+  buf_ = nullptr;
+}
+
+SharedBufferRef AllocateSharedBuffer(size_t bytes) {
+  return SharedBufferRef::Adopt(pool->Allocate(bytes));
+}
+
+Message MakeSharedBufferMessage(uint64_t src_task, SharedBufferRef buf, uint32_t tag) {
+  Message msg{Message::kSharedBuffer, src_task};
+  msg.arg.shared_buffer.buffer = buf.Detach();
+  msg.arg.shared_buffer.tag = tag;
+  return msg;
+}
+
+void DiscardMessage(const Message& msg) {
+  if (msg.type == Message::kSharedBuffer) {
+    SharedBufferRef::Adopt(msg.arg.shared_buffer.buffer).Reset();
+  }
+}
+
+void InitializeSharedBuffer() {
+  pool = new SharedBufferPool;
+}
@@ -0,0 +1,95 @@
+/**
+ * @file shared_buffer.hpp
+ *
+ * タスク間で大きなデータをコピーせずに受け渡すための参照カウント付きバッファ。
+ *
+ * 送信側は AllocateSharedBuffer で確保したバッファに書き込み、
+ * MakeSharedBufferMessage でハンドルだけを Message に載せて送る。
+ * 受信側は SharedBufferRef::Adopt で参照を引き取り、同じ領域をそのまま読む。
+ * 最後の参照がなくなったバッファはプールに戻り、次の確保で再利用される。
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "message.hpp"
+
+class SharedBuffer {
+ public:
+  uint8_t* Data() { return reinterpret_cast<uint8_t*>(this + 1); }
+  const uint8_t* Data() const { return reinterpret_cast<const uint8_t*>(this + 1); }
+  size_t Capacity() const { return capacity_; }
+  /** @brief 書き込んだデータのバイト数。送信側が設定する。 */
+  size_t Size() const { return size_; }
+  void SetSize(size_t size) { size_ = size < capacity_ ? size : capacity_; }
+
+ private:
+  std::atomic<int> refs_{1};
+  size_t capacity_;
+  size_t size_{0};
+  /** @brief プールの大きさのクラス。プールに戻さないバッファは負 */
+  int size_class_;
+  /** @brief プールで空きバッファをつなぐ */
+  SharedBuffer* next_free_{nullptr};
+
+  SharedBuffer(size_t capacity, int size_class)
+    : capacity_{capacity}, size_class_{size_class} {}
+
+  friend class SharedBufferRef;
+  friend class SharedBufferPool;
+};
+
+/** @brief SharedBuffer への参照を 1 つ保持するハンドル。コピーすると参照が増える。 */
+class SharedBufferRef {
+ public:
+  SharedBufferRef() = default;
+  SharedBufferRef(const SharedBufferRef& rhs) : buf_{rhs.buf_} {
+    if (buf_) {
+      buf_->refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  SharedBufferRef(SharedBufferRef&& rhs) noexcept : buf_{std::exchange(rhs.buf_, nullptr)} {}
+  SharedBufferRef& operator=(SharedBufferRef rhs) {
+    std::swap(buf_, rhs.buf_);
+    return *this;
+  }
+  ~SharedBufferRef() { Reset(); }
+
+  /** @brief Message などで受け取った参照 1 つを引き取る。 */
+  static SharedBufferRef Adopt(SharedBuffer* buf) {
+    SharedBufferRef ref;
+    ref.buf_ = buf;
+    return ref;
+  }
+
+  /** @brief 保持している参照を手放さずに取り出す。以後は呼び出し側が参照 1 つを持つ。 */
+  SharedBuffer* Detach() { return std::exchange(buf_, nullptr); }
+  /** @brief 参照を手放す。最後の参照ならバッファをプールに戻す。 */
+  void Reset();
+
+  SharedBuffer* Get() const { return buf_; }
+  SharedBuffer* operator->() const { return buf_; }
+  explicit operator bool() const { return buf_ != nullptr; }
+
+ private:
+  SharedBuffer* buf_{nullptr};
+};
+
+/** @brief bytes 以上の容量を持つバッファを確保する。確保できなければ空のハンドルを返す。 */
+SharedBufferRef AllocateSharedBuffer(size_t bytes);
+
+/** @brief buf の参照を載せたメッセージを作る。tag は受信側がデータの種類を見分けるのに使う。
+ *
+ * メッセージの送信は、成否によらず参照 1 つを必ず引き取る。届かなかったメッセージは送信側で
+ * DiscardMessage される。受信側は、扱わない種類のメッセージも DiscardMessage で捨てる。
+ */
+Message MakeSharedBufferMessage(uint64_t src_task, SharedBufferRef buf, uint32_t tag);
+
+/** @brief 受信せずに捨てるメッセージが持っている資源を解放する。 */
+void DiscardMessage(const Message& msg);
+
+void InitializeSharedBuffer();
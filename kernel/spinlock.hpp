@@ -0,0 +1,71 @@
+/**
+ * @file spinlock.hpp
+ *
+ * 割り込みハンドラとタスクの間で共有するデータを保護するスピンロック。
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/** @brief 割り込みを禁止してから取得するスピンロック。
+ *
+ * 割り込みハンドラからも触るデータを保護するために使う。
+ * 取得している間は割り込みが禁止され、解放すると取得前の割り込み許可状態に戻る。
+ * 保持している間にスリープしてはならない。
+ */
+class SpinLock {
+ public:
+  void Lock() {
+    uint64_t rflags;
+    __asm__ volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(rflags) :: "memory");
+    while (locked_.test_and_set(std::memory_order_acquire)) {
+      __asm__ volatile("pause");
+    }
+    saved_rflags_ = rflags;
+  }
+
+  void Unlock() {
+    const uint64_t rflags = saved_rflags_;
+    locked_.clear(std::memory_order_release);
+    if (rflags & kRFlagsIF) {
+      __asm__ volatile("sti" ::: "memory");
+    }
+  }
+
+  /** @brief 割り込み禁止を保ったままロックを一時的に手放して f を実行する。
+   *
+   * ロックを保持したままタスクを切り替えるときに使う。
+   * 切り替え先のタスクが同じロックを取得しても、戻ってきた時点の割り込み許可状態は変わらない。
+   */
+  template <class F>
+  void ReleaseWhile(F f) {
+    const uint64_t rflags = saved_rflags_;
+    locked_.clear(std::memory_order_release);
+    f();
+    while (locked_.test_and_set(std::memory_order_acquire)) {
+      __asm__ volatile("pause");
+    }
+    saved_rflags_ = rflags;
+  }
+
+ private:
+  static const uint64_t kRFlagsIF = 1u << 9;
+
+  std::atomic_flag locked_ = ATOMIC_FLAG_INIT;
+  uint64_t saved_rflags_{0};
+};
+
+/** @brief スコープを抜けるときに自動的にロックを解放する。 */
+template <class L>
+class LockGuard {
+ public:
+  explicit LockGuard(L& lock) : lock_{lock} { lock_.Lock(); }
+  ~LockGuard() { lock_.Unlock(); }
+  LockGuard(const LockGuard&) = delete;
+  LockGuard& operator=(const LockGuard&) = delete;
+
+ private:
+  L& lock_;
+};
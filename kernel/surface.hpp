@@ -0,0 +1,118 @@
+/**
+ * @file surface.hpp
+ *
+ * 画素形式をテンプレート引数で固定した描画先 Surface を提供する。
+ *
+ * PixelWriter は 1 ピクセルごとに仮想関数を呼ぶが、Surface のメンバ関数はすべてインライン展開でき、
+ * 画素形式の分岐もコンパイル時に消える。画素形式は VisitSurface で 1 度だけ選ぶ。
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+#include "frame_buffer_config.hpp"
+#include "graphics.hpp"
+
+/** @brief 赤・緑・青・予約の順に並ぶ 32 ビット画素形式 */
+struct PixelFormatRGBX8 {
+  static constexpr PixelFormat kFormat = kPixelRGBResv8BitPerColor;
+  static uint32_t Pack(const PixelColor& c) { return PackPixel(kFormat, c); }
+  static PixelColor Unpack(uint32_t v) { return UnpackPixel(kFormat, v); }
+};
+
+/** @brief 青・緑・赤・予約の順に並ぶ 32 ビット画素形式 */
+struct PixelFormatBGRX8 {
+  static constexpr PixelFormat kFormat = kPixelBGRResv8BitPerColor;
+  static uint32_t Pack(const PixelColor& c) { return PackPixel(kFormat, c); }
+  static PixelColor Unpack(uint32_t v) { return UnpackPixel(kFormat, v); }
+};
+
+/** @brief 画素形式 Format の 1 ピクセル 32 ビットの矩形の描画先。
+ *
+ * 画素を持たず、描画先のメモリを指すだけなので値で受け渡す。
+ * PixelWriter と同じ名前の描画関数を持つので、DrawRectangle や WriteAscii などにそのまま渡せる。
+ * 描画関数は範囲外を切り詰める。
+ */
+template <class Format>
+class Surface {
+ public:
+  Surface(uint32_t* base, int stride, Vector2D<int> size)
+    : base_{base}, stride_{stride}, size_{size} {}
+
+  int Width() const { return size_.x; }
+  int Height() const { return size_.y; }
+  Vector2D<int> Size() const { return size_; }
+  uint32_t* RowAt(int y) const { return base_ + stride_ * y; }
+
+  PixelColor At(Vector2D<int> pos) const {
+    return Format::Unpack(RowAt(pos.y)[pos.x]);
+  }
+
+  void Write(Vector2D<int> pos, const PixelColor& c) {
+    if (0 <= pos.x && pos.x < size_.x && 0 <= pos.y && pos.y < size_.y) {
+      RowAt(pos.y)[pos.x] = Format::Pack(c);
+    }
+  }
+
+  void FillSpan(Vector2D<int> pos, int len, const PixelColor& c) {
+    FillRect(pos, {len, 1}, c);
+  }
+
+  void FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor& c) {
+    const int x_begin = std::max(pos.x, 0), x_end = std::min(pos.x + size.x, size_.x);
+    const int y_begin = std::max(pos.y, 0), y_end = std::min(pos.y + size.y, size_.y);
+    if (x_begin >= x_end) {
+      return;
+    }
+    const uint32_t value = Format::Pack(c);
+    for (int y = y_begin; y < y_end; ++y) {
+      FillPixels32(RowAt(y) + x_begin, value, x_end - x_begin);
+    }
+  }
+
+  void WriteRow(Vector2D<int> pos, const PixelColor* colors, int len) {
+    if (pos.y < 0 || pos.y >= size_.y) {
+      return;
+    }
+    const int x_begin = std::max(pos.x, 0), x_end = std::min(pos.x + len, size_.x);
+    uint32_t* p = RowAt(pos.y);
+    for (int x = x_begin; x < x_end; ++x) {
+      p[x] = Format::Pack(colors[x - pos.x]);
+    }
+  }
+
+  /** @brief area の部分を指す Surface を返す。area は範囲内に切り詰める。 */
+  Surface Sub(const Rectangle<int>& area) const {
+    const auto pos = ElementMax(area.pos, {0, 0});
+    const auto end = ElementMin(area.pos + area.size, size_);
+    return {RowAt(pos.y) + pos.x, stride_, ElementMax(end - pos, {0, 0})};
+  }
+
+ private:
+  uint32_t* base_;
+  int stride_;
+  Vector2D<int> size_;
+};
+
+/** @brief config の画素形式に合う Surface を作り、f(surface) を呼ぶ。
+ *
+ * f はジェネリックラムダなど、どちらの Surface も受け取れる関数にする。
+ * 画素形式による分岐はここで 1 度だけ行われ、f の中の描画は仮想関数を介さない。
+ */
+template <class F>
+void VisitSurface(const FrameBufferConfig& config, F&& f) {
+  auto base = reinterpret_cast<uint32_t*>(config.frame_buffer);
+  const int stride = config.pixels_per_scan_line;
+  const Vector2D<int> size{static_cast<int>(config.horizontal_resolution),
+                           static_cast<int>(config.vertical_resolution)};
+  switch (config.pixel_format) {
+  case kPixelRGBResv8BitPerColor:
+    f(Surface<PixelFormatRGBX8>{base, stride, size});
+    break;
+  case kPixelBGRResv8BitPerColor:
+    f(Surface<PixelFormatBGRX8>{base, stride, size});
+    break;
+  }
+}
@@ -0,0 +1,66 @@
+#include "sync.hpp"
+
+#include <algorithm>
+
+#include "task.hpp"
+
+void WaitQueue::Wait(SpinLock& lock) {
+  Task* task = &task_manager->CurrentTask();
+  waiters_.push_back(task);
+
+  // 割り込み禁止のまま待ち条件のロックを手放すので、
+  // スリープするまでの間に WakeOne されて起床を取りこぼすことはない。
+  lock.ReleaseWhile([task]{ task->Sleep(); });
+
+  // メッセージ受信などで起こされた場合は列に残っている
+  auto it = std::find(waiters_.begin(), waiters_.end(), task);
+  if (it != waiters_.end()) {
+    waiters_.erase(it);
+  }
+}
+
+void WaitQueue::WakeOne() {
+  if (waiters_.empty()) {
+    return;
+  }
+  Task* task = waiters_.front();
+  waiters_.pop_front();
+  task->Wakeup();
+}
+
+void WaitQueue::WakeAll() {
+  while (!waiters_.empty()) {
+    WakeOne();
+  }
+}
+
+void Mutex::Lock() {
+  LockGuard guard{lock_};
+  while (owner_) {
+    waiters_.Wait(lock_);
+  }
+  owner_ = &task_manager->CurrentTask();
+}
+
+bool Mutex::TryLock() {
+  LockGuard guard{lock_};
+  if (owner_) {
+    return false;
+  }
+  owner_ = &task_manager->CurrentTask();
+  return true;
+}
+
+void Mutex::Unlock() {
+  LockGuard guard{lock_};
+  owner_ = nullptr;
+  waiters_.WakeOne();
+}
+
+NoPreemptionGuard::NoPreemptionGuard() {
+  task_manager->DisablePreemption();
+}
+
+NoPreemptionGuard::~NoPreemptionGuard() {
+  task_manager->EnablePreemption();
+}
@@ -0,0 +1,62 @@
+/**
+ * @file sync.hpp
+ *
+ * タスク間の同期に使う、スリープを伴う同期機構を集めたファイル。
+ */
+
+#pragma once
+
+#include <deque>
+
+#include "spinlock.hpp"
+
+class Task;
+
+/** @brief 条件が満たされるのを待つタスクの列。
+ *
+ * 待つ条件そのものは呼び出し側が SpinLock で保護し、そのロックを Wait に渡す。
+ * Wait から戻っても条件が成立しているとは限らないので、呼び出し側はループで確認する。
+ */
+class WaitQueue {
+ public:
+  /** @brief lock を保持した状態で呼ぶ。lock を解放して眠り、起こされたら再取得して戻る。 */
+  void Wait(SpinLock& lock);
+  /** @brief 待っているタスクを 1 つ起こす。待つ条件を保護するロックを保持して呼ぶ。 */
+  void WakeOne();
+  /** @brief 待っているタスクをすべて起こす。待つ条件を保護するロックを保持して呼ぶ。 */
+  void WakeAll();
+  bool Empty() const { return waiters_.empty(); }
+
+ private:
+  std::deque<Task*> waiters_{};
+};
+
+/** @brief 取得できるまで眠って待つ排他ロック。
+ *
+ * タスクからのみ使う。割り込みハンドラから使ってはならない。
+ * 保持している間も割り込みは禁止されない。
+ */
+class Mutex {
+ public:
+  void Lock();
+  bool TryLock();
+  void Unlock();
+
+ private:
+  SpinLock lock_;
+  WaitQueue waiters_;
+  Task* owner_{nullptr};
+};
+
+/** @brief スコープ内で現在のタスクが横取りされないようにする。
+ *
+ * 割り込みは禁止しない。スコープ中に起きたタスク切り替えの要求は、
+ * スコープを抜けるときに処理する。自らスリープすることはできる。
+ */
+class NoPreemptionGuard {
+ public:
+  NoPreemptionGuard();
+  ~NoPreemptionGuard();
+  NoPreemptionGuard(const NoPreemptionGuard&) = delete;
+  NoPreemptionGuard& operator=(const NoPreemptionGuard&) = delete;
+};
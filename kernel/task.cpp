@@ -1,28 +1,39 @@
 #include "task.hpp"
 
 #include "asmfunc.h"
+#include "logger.hpp"
 #include "segment.hpp"
+#include "shared_buffer.hpp"
 #include "timer.hpp"
+#include "trace.hpp"
 
 namespace {
-  template <class T, class U>
-  void Erase(T& c, const U& value) {
-    auto it = std::remove(c.begin(), c.end(), value);
-    c.erase(it, c.end());
-  }
-
   void TaskIdle(uint64_t task_id, int64_t data) {
     while (true) __asm__("hlt");
   }
 }
 
+/** @brief タスク関数から戻ったとき TaskReturnTrampoline から呼ばれる。 */
+extern "C" [[noreturn]] void ExitCurrentTask(int exit_code) {
+  task_manager->Exit(exit_code);
+}
+
 Task::Task(uint64_t id) : id_{id}, msgs_{} {
 }
 
-Task& Task::InitContext(TaskFunc* f, int64_t data) {
-  const size_t stack_size = kDefaultStackBytes / sizeof(stack_[0]);
-  stack_.resize(stack_size);
-  uint64_t stack_end = reinterpret_cast<uint64_t>(&stack_[stack_size]);
+Task::~Task() {
+  stack_allocator->Free(stack_);
+}
+
+Task& Task::InitContext(TaskFunc* f, int64_t data, size_t stack_bytes) {
+  stack_allocator->Free(stack_);
+  const auto stack = stack_allocator->Allocate(stack_bytes);
+  if (stack.error) {
+    Log(kError, "failed to allocate a task stack: %s\n", stack.error.Name());
+    exit(1);
+  }
+  stack_ = stack.value;
+  uint64_t stack_end = stack_.Top();
 
   memset(&context_, 0, sizeof(context_));
   context_.cr3 = GetCR3();
@@ -30,14 +41,38 @@ Task& Task::InitContext(TaskFunc* f, int64_t data) {
   context_.cs = kKernelCS;
   context_.ss = kKernelSS;
   context_.rsp = (stack_end & ~0xflu) - 8;
+  // タスク関数の戻り先。戻ってきたらタスクを終了する
+  *reinterpret_cast<uint64_t*>(context_.rsp) =
+    reinterpret_cast<uint64_t>(TaskReturnTrampoline);
 
   context_.rip = reinterpret_cast<uint64_t>(f);
   context_.rdi = id_;
   context_.rsi = data;
 
-  // MXCSR のすべての例外をマスクする
-  *reinterpret_cast<uint32_t*>(&context_.fxsave_area[24]) = 0x1f80;
+  return *this;
+}
+
+void Task::Reset(uint64_t id) {
+  // msgs_ や joiners_, fpu_state_ の領域は確保したまま使い回す
+  id_ = id;
+  stack_ = {};
+  fpu_state_.Reset();
+  msgs_.clear();
+  level_ = kDefaultLevel;
+  running_ = false;
+  weight_ = kDefaultWeight;
+  vruntime_ = 0;
+  stats_ = {};
+  preempt_disable_count_ = 0;
+  wakeup_tsc_ = 0;
+  exited_ = false;
+  detached_ = false;
+  exit_code_ = 0;
+  joiners_.clear();
+}
 
+Task& Task::SetWeight(unsigned int weight) {
+  weight_ = weight > 0 ? weight : 1;
   return *this;
 }
 
@@ -60,11 +95,12 @@ Task& Task::Wakeup() {
 }
 
 void Task::SendMessage(const Message& msg) {
-  msgs_.push_back(msg);
-  Wakeup();
+  LockGuard guard{task_manager->lock_};
+  task_manager->SendMessageLocked(this, msg);
 }
 
 std::optional<Message> Task::ReceiveMessage() {
+  LockGuard guard{task_manager->lock_};
   if (msgs_.empty()) {
     return std::nullopt;
   }
@@ -74,120 +110,338 @@ std::optional<Message> Task::ReceiveMessage() {
   return m;
 }
 
-TaskManager::TaskManager() {
+Message Task::WaitMessage() {
+  LockGuard guard{task_manager->lock_};
+  // 確認からスリープまでロックを保持するので、その間に届いたメッセージを取りこぼさない
+  while (msgs_.empty()) {
+    task_manager->SleepLocked(this);
+  }
+
+  auto m = msgs_.front();
+  msgs_.pop_front();
+  return m;
+}
+
+void Task::Exit(int exit_code) {
+  task_manager->Exit(exit_code);
+}
+
+Task& Task::Detach() {
+  LockGuard guard{task_manager->lock_};
+  detached_ = true;
+  auto& exited = task_manager->exited_tasks_;
+  if (exited_ && std::find(exited.begin(), exited.end(), this) == exited.end()) {
+    // 資源の解放が済んでいるので、すぐに回収する
+    task_manager->RecycleTask(this);
+  }
+  return *this;
+}
+
+TaskManager::TaskManager() : reap_work_{ReapExitedTasks, reinterpret_cast<int64_t>(this)} {
+  // 起床直後のタスクは 10 ミリ秒分だけ前に並べ、1 ミリ秒以上先行していれば横取りさせる
+  sleeper_credit_ = tsc_freq / 100;
+  wakeup_granularity_ = tsc_freq / 1000;
+
   Task& task = NewTask()
     .SetLevel(current_level_)
     .SetRunning(true);
-  running_[current_level_].push_back(&task);
+  current_task_ = &task;
+  fpu_owner_ = &task;
 
   Task& idle = NewTask()
     .InitContext(TaskIdle, 0)
     .SetLevel(0)
     .SetRunning(true);
-  running_[0].push_back(&idle);
+  running_[0].insert(&idle);
+  idle_task_ = &idle;
+
+  start_tsc_ = exec_start_tsc_ = ReadTSC();
 }
 
 Task& TaskManager::NewTask() {
-  latest_id_++;
-  return *tasks_.emplace_back(new Task{latest_id_});
+  LockGuard guard{lock_};
+  uint64_t id;
+  if (free_ids_.empty()) {
+    id = ++latest_id_;
+  } else {
+    // 同じスロットでも世代を進め、終了したタスクの ID を持つ側が新しいタスクに届かないようにする
+    id = free_ids_.front() + (1ul << kTaskSlotBits);
+    free_ids_.pop_front();
+  }
+
+  if (free_tasks_.empty()) {
+    return *tasks_.emplace_back(new Task{id});
+  }
+  auto& task = tasks_.emplace_back(std::move(free_tasks_.back()));
+  free_tasks_.pop_back();
+  task->Reset(id);
+  return *task;
 }
 
 void TaskManager::SwitchTask(bool current_sleep) {
-  auto& level_queue = running_[current_level_];
-  Task* current_task = level_queue.front();
-  level_queue.pop_front();
-  if (!current_sleep) {
-    level_queue.push_back(current_task);
+  LockGuard guard{lock_};
+  SwitchTaskLocked(current_sleep);
+}
+
+void TaskManager::SwitchTaskLocked(bool current_sleep) {
+  Task* current_task = current_task_;
+  if (!current_sleep && current_task->preempt_disable_count_ > 0) {
+    // 横取りが許可されたときに切り替える
+    resched_ = true;
+    return;
   }
-  if (level_queue.empty()) {
-    level_changed_ = true;
+
+  UpdateCurrentRuntime();
+  resched_ = false;
+
+  if (!current_sleep) {
+    running_[current_task->Level()].insert(current_task);
   }
 
-  if (level_changed_) {
-    level_changed_ = false;
-    for (int lv = kMaxLevel; lv >= 0; lv--) {
-      if (!running_[lv].empty()) {
-        current_level_ = lv;
-        break;
-      }
+  for (int lv = kMaxLevel; lv >= 0; lv--) {
+    if (!running_[lv].empty()) {
+      current_level_ = lv;
+      break;
     }
   }
 
-  Task* next_task = running_[current_level_].front();
-
-  SwitchContext(&next_task->Context(), &current_task->Context());
-}
+  auto& level_tasks = running_[current_level_];
+  Task* next_task = *level_tasks.begin();
+  level_tasks.erase(level_tasks.begin());
+  current_task_ = next_task;
+  min_vruntime_[current_level_] =
+    std::max(min_vruntime_[current_level_], next_task->vruntime_);
 
-void TaskManager::Sleep(Task* task) {
-  if (!task->Running()) {
+  if (next_task == current_task) {
     return;
   }
 
-  task->SetRunning(false);
+  Trace(TraceEventType::kSwitch, current_task->ID(), next_task->ID(),
+        current_sleep ? kTraceSwitchSleep : kTraceSwitchPreempt, current_level_);
 
-  if (task == running_[current_level_].front()) {
-    SwitchTask(true);
-    return;
+  if (current_sleep) {
+    current_task->stats_.voluntary_switches++;
+  } else {
+    current_task->stats_.involuntary_switches++;
+  }
+  if (next_task->wakeup_tsc_ != 0) {
+    const uint64_t latency = exec_start_tsc_ - next_task->wakeup_tsc_;
+    auto& stats = next_task->stats_;
+    stats.wakeups++;
+    stats.wakeup_latency_sum_tsc += latency;
+    stats.wakeup_latency_max_tsc = std::max(stats.wakeup_latency_max_tsc, latency);
+    next_task->wakeup_tsc_ = 0;
   }
 
-  Erase(running_[task->Level()], task);
+  // 切り替え先のタスクが lock_ を取得できるよう、割り込み禁止のままロックを手放す
+  lock_.ReleaseWhile([&]{
+    SwitchContext(&next_task->Context(), &current_task->Context());
+  });
+}
+
+void TaskManager::Sleep(Task* task) {
+  LockGuard guard{lock_};
+  SleepLocked(task);
 }
 
 Error TaskManager::Sleep(uint64_t id) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                         [id](const auto& t){ return t->ID() == id; });
-  if (it == tasks_.end()) {
+  LockGuard guard{lock_};
+  Task* task = FindTask(id);
+  if (!task) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  Sleep(it->get());
+  SleepLocked(task);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 void TaskManager::Wakeup(Task* task, int level) {
-  if (task->Running()) {
-    ChangeLevelRunning(task, level);
-    return;
+  LockGuard guard{lock_};
+  WakeupLocked(task, level);
+}
+
+Error TaskManager::Wakeup(uint64_t id, int level) {
+  LockGuard guard{lock_};
+  Task* task = FindTask(id);
+  if (!task) {
+    return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  if (level < 0) {
-    level = task->Level();
+  WakeupLocked(task, level);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error TaskManager::SendMessage(uint64_t id, const Message& msg) {
+  LockGuard guard{lock_};
+  Task* task = FindTask(id);
+  if (!task) {
+    DiscardMessage(msg);
+    return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  task->SetLevel(level);
-  task->SetRunning(true);
+  SendMessageLocked(task, msg);
+  return MAKE_ERROR(Error::kSuccess);
+}
 
-  running_[level].push_back(task);
-  if (level > current_level_) {
-    level_changed_ = true;
+void TaskManager::Exit(int exit_code) {
+  LockGuard guard{lock_};
+  Task* task = current_task_;
+  task->exited_ = true;
+  task->exit_code_ = exit_code;
+  Trace(TraceEventType::kExit, task->ID(), task->ID(), 0, task->Level());
+  task->SetRunning(false);
+  if (fpu_owner_ == task) {
+    fpu_owner_ = nullptr;
   }
-  return;
+  exited_tasks_.push_back(task);
+
+  for (Task* joiner : task->joiners_) {
+    WakeupLocked(joiner, -1);
+  }
+  task->joiners_.clear();
+
+  // 自分のスタックは自分では解放できないので、切り替えた後でワーカータスクに解放させる。
+  // 割り込みは禁止したままなので、切り替えるまでワーカータスクは動かない。
+  if (work_queue) {
+    lock_.ReleaseWhile([this]{ work_queue->Schedule(&reap_work_); });
+  }
+
+  SwitchTaskLocked(true);
+  while (true) __asm__("hlt");
 }
 
-Error TaskManager::Wakeup(uint64_t id, int level) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                         [id](const auto& t){ return t->ID() == id; });
-  if (it == tasks_.end()) {
-    return MAKE_ERROR(Error::kNoSuchTask);
+WithError<int> TaskManager::Join(uint64_t id) {
+  LockGuard guard{lock_};
+  while (true) {
+    // 眠っている間に回収されて ID が再利用されうるので、起きるたびに探し直す
+    Task* task = FindTask(id);
+    if (!task || task == current_task_) {
+      return {0, MAKE_ERROR(Error::kNoSuchTask)};
+    }
+
+    if (task->exited_) {
+      const int exit_code = task->exit_code_;
+      if (auto it = std::find(exited_tasks_.begin(), exited_tasks_.end(), task);
+          it != exited_tasks_.end()) {
+        exited_tasks_.erase(it);
+        ReleaseTaskResources(task);
+      }
+      RecycleTask(task);
+      return {exit_code, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    auto& joiners = task->joiners_;
+    if (std::find(joiners.begin(), joiners.end(), current_task_) == joiners.end()) {
+      joiners.push_back(current_task_);
+    }
+    SleepLocked(current_task_);
   }
+}
 
-  Wakeup(it->get(), level);
-  return MAKE_ERROR(Error::kSuccess);
+Task& TaskManager::CurrentTask() {
+  return *current_task_;
 }
 
-Error TaskManager::SendMessage(uint64_t id, const Message& msg) {
+TaskStatsSnapshot TaskManager::CollectStats() {
+  LockGuard guard{lock_};
+  UpdateCurrentRuntime();
+
+  TaskStatsSnapshot snapshot{start_tsc_, exec_start_tsc_, {}};
+  snapshot.tasks.reserve(tasks_.size());
+  for (const auto& task : tasks_) {
+    snapshot.tasks.push_back(TaskStatsEntry{
+      task->ID(), task->Level(), task->Running(), task.get() == idle_task_,
+      task->Weight(), task->Stats()
+    });
+  }
+  return snapshot;
+}
+
+void TaskManager::DisablePreemption() {
+  LockGuard guard{lock_};
+  current_task_->preempt_disable_count_++;
+}
+
+void TaskManager::EnablePreemption() {
+  LockGuard guard{lock_};
+  if (--current_task_->preempt_disable_count_ == 0 && resched_) {
+    SwitchTaskLocked(false);
+  }
+}
+
+void TaskManager::SwitchFPUOwner() {
+  ClearTS();
+
+  Task* current = &CurrentTask();
+  if (fpu_owner_ == current) {
+    return;
+  }
+
+  if (fpu_owner_) {
+    fpu_owner_->fpu_state_.Save();
+  }
+  current->fpu_state_.Restore();
+  fpu_owner_ = current;
+}
+
+Task* TaskManager::FindTask(uint64_t id) {
   auto it = std::find_if(tasks_.begin(), tasks_.end(),
                          [id](const auto& t){ return t->ID() == id; });
   if (it == tasks_.end()) {
-    return MAKE_ERROR(Error::kNoSuchTask);
+    return nullptr;
+  }
+  return it->get();
+}
+
+void TaskManager::SleepLocked(Task* task) {
+  if (!task->Running()) {
+    return;
   }
 
-  (*it)->SendMessage(msg);
-  return MAKE_ERROR(Error::kSuccess);
+  Trace(TraceEventType::kSleep, current_task_->ID(), task->ID(), 0, task->Level());
+  task->SetRunning(false);
+
+  if (task == current_task_) {
+    SwitchTaskLocked(true);
+    return;
+  }
+
+  running_[task->Level()].erase(task);
 }
 
-Task& TaskManager::CurrentTask() {
-  return *running_[current_level_].front();
+void TaskManager::WakeupLocked(Task* task, int level) {
+  if (task->exited_) {
+    return;
+  }
+  if (task->Running()) {
+    ChangeLevelRunning(task, level);
+    return;
+  }
+
+  if (level < 0) {
+    level = task->Level();
+  }
+
+  Trace(TraceEventType::kWakeup, current_task_->ID(), task->ID(), 0, level);
+  task->SetLevel(level);
+  task->SetRunning(true);
+  task->wakeup_tsc_ = ReadTSC();
+  PlaceWokenTask(task);
+
+  running_[level].insert(task);
+  CheckPreemptWakeup(task);
+  return;
+}
+
+void TaskManager::SendMessageLocked(Task* task, const Message& msg) {
+  if (task->exited_) {
+    DiscardMessage(msg);
+    return;
+  }
+  Trace(TraceEventType::kSendMessage, current_task_->ID(), task->ID(),
+        msg.type, task->Level());
+  task->msgs_.push_back(msg);
+  WakeupLocked(task, -1);
 }
 
 void TaskManager::ChangeLevelRunning(Task* task, int level) {
@@ -195,26 +449,107 @@ void TaskManager::ChangeLevelRunning(Task* task, int level) {
     return;
   }
 
-  if (task != running_[current_level_].front()) {
+  if (task != current_task_) {
     // change level of other task
-    Erase(running_[task->Level()], task);
-    running_[level].push_back(task);
+    running_[task->Level()].erase(task);
     task->SetLevel(level);
+    task->vruntime_ = min_vruntime_[level];
+    running_[level].insert(task);
     if (level > current_level_) {
-      level_changed_ = true;
+      resched_ = true;
     }
     return;
   }
 
   // change level myself
-  running_[current_level_].pop_front();
-  running_[level].push_front(task);
+  UpdateCurrentRuntime();
   task->SetLevel(level);
-  if (level >= current_level_) {
-    current_level_ = level;
-  } else {
-    current_level_ = level;
-    level_changed_ = true;
+  task->vruntime_ = min_vruntime_[level];
+  current_level_ = level;
+  for (int lv = kMaxLevel; lv > level; lv--) {
+    if (!running_[lv].empty()) {
+      resched_ = true;
+      break;
+    }
+  }
+}
+
+/**
+ * @brief 前回の計上以降に current_task_ が使った TSC を実行時間に加え、
+ * 重みで割った値を vruntime に加える。
+ */
+void TaskManager::UpdateCurrentRuntime() {
+  const uint64_t now = ReadTSC();
+  const uint64_t delta = now - exec_start_tsc_;
+  exec_start_tsc_ = now;
+  current_task_->stats_.run_tsc += delta;
+  current_task_->vruntime_ += delta * Task::kDefaultWeight / current_task_->weight_;
+}
+
+/**
+ * @brief 起床したタスクの vruntime をレベルの基準値の近くに置き直す。
+ *
+ * 長く眠っていたタスクが溜め込んだ差で CPU を独占しないよう基準値まで引き上げる。
+ * ただし sleeper_credit_ 分は前に置き、頻繁に眠る対話的なタスクが早く実行されるようにする。
+ */
+void TaskManager::PlaceWokenTask(Task* task) {
+  const uint64_t min_v = min_vruntime_[task->Level()];
+  const uint64_t floor = min_v > sleeper_credit_ ? min_v - sleeper_credit_ : 0;
+  task->vruntime_ = std::max(task->vruntime_, floor);
+}
+
+/** @brief 起床したタスクが現在のタスクより優先されるなら、次の割り込みで切り替える。 */
+void TaskManager::CheckPreemptWakeup(Task* task) {
+  if (task->Level() > current_level_) {
+    resched_ = true;
+    return;
+  }
+  if (task->Level() < current_level_) {
+    return;
+  }
+
+  UpdateCurrentRuntime();
+  if (task->vruntime_ + wakeup_granularity_ < current_task_->vruntime_) {
+    resched_ = true;
+  }
+}
+
+/** @brief 終了したタスクのスタックとメッセージを解放する。current_task_ 以外に対して呼ぶ。 */
+void TaskManager::ReleaseTaskResources(Task* task) {
+  stack_allocator->Free(task->stack_);
+  task->stack_ = {};
+  for (const auto& msg : task->msgs_) {
+    DiscardMessage(msg);
+  }
+  task->msgs_.clear();
+}
+
+/** @brief タスクを一覧から外し、オブジェクトと ID のスロットを次の NewTask で再利用できるようにする。 */
+void TaskManager::RecycleTask(Task* task) {
+  auto it = std::find_if(tasks_.begin(), tasks_.end(),
+                         [task](const auto& t){ return t.get() == task; });
+  free_ids_.push_back(task->ID());
+  free_tasks_.push_back(std::move(*it));
+  tasks_.erase(it);
+}
+
+void TaskManager::ReapExitedTasks(int64_t data) {
+  auto manager = reinterpret_cast<TaskManager*>(data);
+  LockGuard guard{manager->lock_};
+  auto& exited = manager->exited_tasks_;
+  for (auto it = exited.begin(); it != exited.end();) {
+    Task* task = *it;
+    if (task == manager->current_task_) {
+      // まだ自分のスタックの上で切り替え中
+      ++it;
+      continue;
+    }
+
+    manager->ReleaseTaskResources(task);
+    it = exited.erase(it);
+    if (task->detached_) {
+      manager->RecycleTask(task);
+    }
   }
 }
 
@@ -223,8 +558,6 @@ TaskManager* task_manager;
 void InitializeTask() {
   task_manager = new TaskManager;
 
-  __asm__("cli");
   timer_manager->AddTimer(
       Timer{timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue});
-  __asm__("sti");
 }
@@ -11,60 +11,148 @@
 #include <cstdint>
 #include <deque>
 #include <optional>
+#include <set>
 #include <vector>
 
 #include "error.hpp"
+#include "fpu.hpp"
 #include "message.hpp"
+#include "spinlock.hpp"
+#include "task_stack.hpp"
+#include "workqueue.hpp"
 
 struct TaskContext {
   uint64_t cr3, rip, rflags, reserved1; // offset 0x00
   uint64_t cs, ss, fs, gs; // offset 0x20
   uint64_t rax, rbx, rcx, rdx, rdi, rsi, rsp, rbp; // offset 0x40
   uint64_t r8, r9, r10, r11, r12, r13, r14, r15; // offset 0x80
-  std::array<uint8_t, 512> fxsave_area; // offset 0xc0
 } __attribute__((packed));
 
 using TaskFunc = void (uint64_t, int64_t);
 
+/** @brief タスクごとの実行統計。時間はすべて TSC カウントで表す。 */
+struct TaskStats {
+  uint64_t run_tsc{0};
+  /** @brief 自らスリープして CPU を手放した回数 */
+  uint64_t voluntary_switches{0};
+  /** @brief タイマーや優先タスクの起床によって CPU を奪われた回数 */
+  uint64_t involuntary_switches{0};
+  /** @brief 起床から実際に実行されるまでの待ち時間 */
+  uint64_t wakeups{0};
+  uint64_t wakeup_latency_sum_tsc{0};
+  uint64_t wakeup_latency_max_tsc{0};
+};
+
 class TaskManager;
 
+/** @brief タスク ID の下位ビットはスロット番号、上位ビットはそのスロットの世代。
+ *
+ * 終了したタスクのスロットは再利用するが、世代を 1 つ進めるので ID 全体は重ならない。
+ * 古い ID を持ち続けている側（タイマーやメッセージの宛先など）は、新しいタスクではなく kNoSuchTask に当たる。
+ */
+const int kTaskSlotBits = 32;
+inline uint64_t TaskSlot(uint64_t id) { return id & ((1ul << kTaskSlotBits) - 1); }
+inline uint64_t TaskGeneration(uint64_t id) { return id >> kTaskSlotBits; }
+
 class Task {
  public:
   static const int kDefaultLevel = 1;
-  static const size_t kDefaultStackBytes = 4096;
+  /** @brief InitContext でスタックの大きさを指定しなかったときの大きさ */
+  static const size_t kDefaultStackBytes = 16 * 1024;
+  /** @brief 重みの基準値。この重みのタスクは実時間と同じ速さで vruntime が進む。 */
+  static const unsigned int kDefaultWeight = 1024;
 
   Task(uint64_t id);
-  Task& InitContext(TaskFunc* f, int64_t data);
+  ~Task();
+  Task& InitContext(TaskFunc* f, int64_t data,
+                    size_t stack_bytes = kDefaultStackBytes);
   TaskContext& Context();
   uint64_t ID() const;
   Task& Sleep();
   Task& Wakeup();
   void SendMessage(const Message& msg);
   std::optional<Message> ReceiveMessage();
+  /** @brief メッセージが届くまで眠って待ち、届いたメッセージを返す。現在のタスクからのみ呼べる。 */
+  Message WaitMessage();
+  /** @brief このタスクを終了する。現在のタスクからのみ呼べる。タスク関数から戻っても終了コード 0 で終了する。 */
+  [[noreturn]] void Exit(int exit_code);
+  /** @brief 終了したら Join を待たずに回収させる。 */
+  Task& Detach();
   
   int Level() const { return level_; }
   bool Running() const { return running_; }
+  bool Exited() const { return exited_; }
+  unsigned int Weight() const { return weight_; }
+  /** @brief 同じレベル内での CPU 時間の配分比を設定する。大きいほど多く割り当てられる。 */
+  Task& SetWeight(unsigned int weight);
+  /** @brief 重みで正規化した実行時間（TSC カウント）。小さいタスクほど先に実行される。 */
+  uint64_t VRuntime() const { return vruntime_; }
+  const TaskStats& Stats() const { return stats_; }
 
  private:
   uint64_t id_;
-  std::vector<uint64_t> stack_;
+  /** @brief ガードページ付きのスタック。InitContext を呼ぶまでは割り当てない。 */
+  TaskStack stack_{};
   alignas(16) TaskContext context_;
+  FPUState fpu_state_;
   std::deque<Message> msgs_;
   unsigned int level_{kDefaultLevel};
   bool running_{false};
-
+  unsigned int weight_{kDefaultWeight};
+  uint64_t vruntime_{0};
+  TaskStats stats_{};
+  /** @brief 0 より大きい間は他のタスクに横取りされない */
+  int preempt_disable_count_{0};
+  /** @brief 起床した時刻の TSC。実行が始まるまでは非 0 */
+  uint64_t wakeup_tsc_{0};
+  /** @brief 終了したタスクは二度と実行されず、Join されるか回収されるのを待つ */
+  bool exited_{false};
+  bool detached_{false};
+  int exit_code_{0};
+  /** @brief Join でこのタスクの終了を待っているタスク */
+  std::vector<Task*> joiners_{};
+
+  /** @brief 回収したタスクを新しいタスク id として再利用できるよう初期状態に戻す。 */
+  void Reset(uint64_t id);
   Task& SetLevel(int level) { level_ = level; return *this; }
   Task& SetRunning(bool running) { running_ = running; return *this; }
 
   friend TaskManager;
 };
 
+/** @brief vruntime の小さい順（同じならタスク ID の小さい順）に並べる比較関数 */
+struct TaskVRuntimeLess {
+  bool operator()(const Task* lhs, const Task* rhs) const {
+    if (lhs->VRuntime() != rhs->VRuntime()) {
+      return lhs->VRuntime() < rhs->VRuntime();
+    }
+    return lhs->ID() < rhs->ID();
+  }
+};
+
+/** @brief TaskManager::CollectStats が返す 1 タスク分の情報 */
+struct TaskStatsEntry {
+  uint64_t id;
+  int level;
+  bool running;
+  bool idle;
+  unsigned int weight;
+  TaskStats stats;
+};
+
+struct TaskStatsSnapshot {
+  uint64_t start_tsc; // TaskManager を初期化した時刻
+  uint64_t tsc; // 統計を採取した時刻
+  std::vector<TaskStatsEntry> tasks;
+};
+
 class TaskManager {
  public:
   // level: 0 = lowest, kMaxLevel = highest
   static const int kMaxLevel = 3;
 
   TaskManager();
+  /** @brief タスクを生成する。回収済みのタスクがあれば、その ID とオブジェクトを再利用する。 */
   Task& NewTask();
   void SwitchTask(bool current_sleep = false);
 
@@ -72,17 +160,81 @@ class TaskManager {
   Error Sleep(uint64_t id);
   void Wakeup(Task* task, int level = -1);
   Error Wakeup(uint64_t id, int level = -1);
+  /** @brief タスク id にメッセージを送る。
+   *
+   * 宛先が見つからなくても、終了済みでも、msg が持つ資源の参照は必ず引き取られる。
+   * 呼び出し側は戻り値によらず msg の資源を解放しない。
+   */
   Error SendMessage(uint64_t id, const Message& msg);
+  /** @brief 現在のタスクを終了する。スタックなどの資源は回収用のワークが解放する。 */
+  [[noreturn]] void Exit(int exit_code);
+  /** @brief タスク id が終了するまで眠って待ち、終了コードを返す。待ち終えたタスクは回収される。 */
+  WithError<int> Join(uint64_t id);
   Task& CurrentTask();
+  /** @brief 現在のタスクより優先すべきタスクが起床し、切り替えを待っているか */
+  bool ReschedulePending() const { return resched_; }
+  /** @brief 全タスクの実行統計を採取する。実行中のタスクの実行時間も現在まで計上する。 */
+  TaskStatsSnapshot CollectStats();
+
+  /** @brief 現在のタスクの横取りを禁止する。入れ子にできる。NoPreemptionGuard から使う。 */
+  void DisablePreemption();
+  /** @brief 横取りの禁止を 1 段解除し、保留していた切り替えがあれば行う。 */
+  void EnablePreemption();
+
+  /** @brief #NM 例外から呼ばれ、FPU/SSE 状態を現在のタスクのものに切り替える。 */
+  void SwitchFPUOwner();
 
  private:
   std::vector<std::unique_ptr<Task>> tasks_{};
+  /** @brief FPU/SSE レジスタに状態が載っているタスク */
+  Task* fpu_owner_{nullptr};
   uint64_t latest_id_{0};
-  std::array<std::deque<Task*>, kMaxLevel + 1> running_{};
+  /** @brief 実行可能だが CPU を使っていないタスク。current_task_ は含まない。 */
+  std::array<std::set<Task*, TaskVRuntimeLess>, kMaxLevel + 1> running_{};
+  /** @brief 各レベルの vruntime の基準値。最後に実行を始めたタスクの vruntime に追従して単調増加する。 */
+  std::array<uint64_t, kMaxLevel + 1> min_vruntime_{};
+  Task* current_task_{nullptr};
+  Task* idle_task_{nullptr};
   int current_level_{kMaxLevel};
-  bool level_changed_{false};
-
+  bool resched_{false};
+  /** @brief current_task_ の実行時間を最後に計上したときの TSC */
+  uint64_t exec_start_tsc_{0};
+  uint64_t start_tsc_{0};
+  /** @brief 起床したタスクに与える vruntime の猶予（TSC カウント） */
+  uint64_t sleeper_credit_{0};
+  /** @brief 起床したタスクが現在のタスクを横取りするのに必要な vruntime の差 */
+  uint64_t wakeup_granularity_{0};
+
+  /** @brief 終了したが、まだスタックなどを解放していないタスク */
+  std::vector<Task*> exited_tasks_{};
+  /** @brief 回収して再利用を待っているタスクのオブジェクトと、最後に使った ID。
+   *
+   * スロットは古いものから再利用し、世代を進めた ID を割り当てる。
+   */
+  std::vector<std::unique_ptr<Task>> free_tasks_{};
+  std::deque<uint64_t> free_ids_{};
+  /** @brief exited_tasks_ を回収するワーク */
+  Work reap_work_;
+
+  /** @brief タスク一覧と実行キュー、各タスクのメッセージキューを保護する */
+  SpinLock lock_;
+
+  // 以下のメンバ関数は lock_ を保持した状態で呼ぶ
+  Task* FindTask(uint64_t id);
+  void SwitchTaskLocked(bool current_sleep);
+  void SleepLocked(Task* task);
+  void WakeupLocked(Task* task, int level);
+  void SendMessageLocked(Task* task, const Message& msg);
   void ChangeLevelRunning(Task* task, int level);
+  void UpdateCurrentRuntime();
+  void PlaceWokenTask(Task* task);
+  void CheckPreemptWakeup(Task* task);
+  void ReleaseTaskResources(Task* task);
+  void RecycleTask(Task* task);
+
+  static void ReapExitedTasks(int64_t data);
+
+  friend Task;
 };
 
 extern TaskManager* task_manager;
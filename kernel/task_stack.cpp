@@ -0,0 +1,50 @@
+#include "task_stack.hpp"
+
+#include <algorithm>
+
+#include "paging.hpp"
+
+WithError<TaskStack> StackAllocator::Allocate(size_t bytes) {
+  const size_t pages = std::max<size_t>(1, (bytes + kBytesPerFrame - 1) / kBytesPerFrame);
+
+  LockGuard guard{lock_};
+  if (auto it = pool_.find(pages); it != pool_.end() && !it->second.empty()) {
+    const uintptr_t base = it->second.back();
+    it->second.pop_back();
+    return {TaskStack{base, pages}, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  const auto frame = memory_manager->Allocate(pages + 1);
+  if (frame.error) {
+    return {TaskStack{}, frame.error};
+  }
+
+  const auto base = reinterpret_cast<uintptr_t>(frame.value.Frame());
+  if (auto err = SetPagePresent(base, false)) {
+    memory_manager->Free(frame.value, pages + 1);
+    return {TaskStack{}, err};
+  }
+  guard_pages_.push_back(base);
+  return {TaskStack{base, pages}, MAKE_ERROR(Error::kSuccess)};
+}
+
+void StackAllocator::Free(const TaskStack& stack) {
+  if (stack.base == 0) {
+    return;
+  }
+  LockGuard guard{lock_};
+  pool_[stack.pages].push_back(stack.base);
+}
+
+bool StackAllocator::IsGuardPage(uintptr_t addr) const {
+  // ページフォルトは lock_ を保持したまま起きうるのでロックを取らない。
+  // 呼び出し元のハンドラは調べた後に停止するだけなので、厳密さより確実に戻ることを優先する。
+  const uintptr_t page = addr & ~static_cast<uintptr_t>(kBytesPerFrame - 1);
+  return std::find(guard_pages_.begin(), guard_pages_.end(), page) != guard_pages_.end();
+}
+
+StackAllocator* stack_allocator;
+
+void InitializeStackAllocator() {
+  stack_allocator = new StackAllocator;
+}
@@ -0,0 +1,54 @@
+/**
+ * @file task_stack.hpp
+ *
+ * タスクのスタックを割り当てるアロケータ。
+ *
+ * スタックはページ境界に揃えて物理フレームから切り出し、最下位のページを
+ * ガードページとして外しておく。スタックが溢れるとガードページに触れて
+ * ページフォルトが発生するので、黙って隣の領域を壊すことがない。
+ * 解放されたスタックは大きさごとにプールしておき、次の割り当てで再利用する。
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "error.hpp"
+#include "memory_manager.hpp"
+#include "spinlock.hpp"
+
+/** @brief StackAllocator が割り当てたスタック 1 本 */
+struct TaskStack {
+  /** @brief ガードページの先頭アドレス。0 なら割り当てられていない。 */
+  uintptr_t base{0};
+  /** @brief ガードページを除いたページ数 */
+  size_t pages{0};
+
+  /** @brief スタックの終端（最初に push される位置の直後）のアドレス */
+  uintptr_t Top() const { return base + (pages + 1) * kBytesPerFrame; }
+};
+
+class StackAllocator {
+ public:
+  /** @brief bytes 以上の大きさのスタックを割り当てる。大きさはページ単位に切り上げる。 */
+  WithError<TaskStack> Allocate(size_t bytes);
+  /** @brief スタックをプールに戻す。ガードページは外したまま再利用する。 */
+  void Free(const TaskStack& stack);
+
+  /** @brief addr がいずれかのスタックのガードページ内にあるか。ページフォルトハンドラから呼ぶ。 */
+  bool IsGuardPage(uintptr_t addr) const;
+
+ private:
+  SpinLock lock_;
+  /** @brief ページ数ごとの、解放済みで再利用できるスタックの base */
+  std::map<size_t, std::vector<uintptr_t>> pool_{};
+  /** @brief これまでに作ったすべてのガードページ。スタックは物理フレームに戻さないので増える一方。 */
+  std::vector<uintptr_t> guard_pages_{};
+};
+
+extern StackAllocator* stack_allocator;
+
+void InitializeStackAllocator();
@@ -8,6 +8,10 @@
 #include "fat.hpp"
 #include "asmfunc.h"
 #include "elf.hpp"
+#include "timer.hpp"
+#include "trace.hpp"
+#include "serial.hpp"
+#include "shared_buffer.hpp"
 
 namespace {
   std::vector<char*> MakeArgVector(char* command, char* first_arg) {
@@ -68,7 +72,9 @@ Rectangle<int> Terminal::BlinkCursor() {
 
 void Terminal::DrawCursor(bool visible) {
   const auto color = visible ? ToColor(0xffffff) : ToColor(0);
-  FillRectangle(*window_->Writer(), CalcCursorPos(), {7, 15}, color);
+  window_->Paint([&](auto surface) {
+    FillRectangle(surface, CalcCursorPos(), {7, 15}, color);
+  });
 }
 
 Vector2D<int> Terminal::CalcCursorPos() const {
@@ -97,13 +103,18 @@ Rectangle<int> Terminal::InputKey(
       Scroll1();
     }
     ExecuteLine();
+    if (top_running_) {
+      return {ToplevelWindow::kTopLeftMargin, window_->InnerSize()};
+    }
     Print("$ ");
     draw_area.pos = ToplevelWindow::kTopLeftMargin;
     draw_area.size = window_->InnerSize();
   } else if (ascii == '\b') {
     if (cursor_.x > 0) {
       cursor_.x--;
-      FillRectangle(*window_->Writer(), CalcCursorPos(), {8, 16}, {0, 0, 0});
+      window_->Paint([&](auto surface) {
+        FillRectangle(surface, CalcCursorPos(), {8, 16}, {0, 0, 0});
+      });
       draw_area.pos = CalcCursorPos();
 
       if (linebuf_index_ > 0) {
@@ -114,7 +125,9 @@ Rectangle<int> Terminal::InputKey(
     if (cursor_.x < kColumns - 1 && linebuf_index_ < kLineMax - 1) {
       linebuf_[linebuf_index_] = ascii;
       linebuf_index_++;
-      WriteAscii(*window_->Writer(), CalcCursorPos(), ascii, {255, 255, 255});
+      window_->Paint([&](auto surface) {
+        WriteAscii(surface, CalcCursorPos(), ascii, {255, 255, 255});
+      });
       cursor_.x++;
     }
   } else if (keycode == 0x51) {
@@ -179,6 +192,21 @@ void Terminal::ExecuteLine() {
       }
       Print(s);
     }
+  } else if (strcmp(command, "top") == 0) {
+    StartTop();
+  } else if (strcmp(command, "trace") == 0) {
+    ExecuteTrace(first_arg);
+  } else if (strcmp(command, "compstat") == 0) {
+    const auto stats = layer_manager->Stats();
+    char s[64];
+    sprintf(s, "frames:     %lu\n", stats.frames);
+    Print(s);
+    sprintf(s, "composited: %lu px\n", stats.composited_pixels);
+    Print(s);
+    sprintf(s, "presented:  %lu px\n", stats.presented_pixels);
+    Print(s);
+    sprintf(s, "blitted:    %lu px\n", stats.blitted_pixels);
+    Print(s);
   } else if (strcmp(command, "cat") == 0) {
     char s[64];
 
@@ -269,7 +297,9 @@ void Terminal::Print(char c) {
   if (c == '\n') {
     newline();
   } else {
-    WriteAscii(*window_->Writer(), CalcCursorPos(), c, {255, 255, 255});
+    window_->Paint([&](auto surface) {
+      WriteAscii(surface, CalcCursorPos(), c, {255, 255, 255});
+    });
     if (cursor_.x == kColumns - 1) {
       newline();
     } else {
@@ -312,8 +342,6 @@ Rectangle<int> Terminal::HistoryUpDown(int direction) {
   const auto first_pos = CalcCursorPos();
 
   Rectangle<int> draw_area ={first_pos, {8*kColumns - 1, 16}};
-  FillRectangle(*window_->Writer(), draw_area.pos, draw_area.size, {0, 0, 0});
-
   const char* history = "";
   if (cmd_history_index_ >= 0) {
     history = &cmd_history_[cmd_history_index_][0];
@@ -322,54 +350,237 @@ Rectangle<int> Terminal::HistoryUpDown(int direction) {
   strcpy(&linebuf_[0], history);
   linebuf_index_ = strlen(history);
 
-  WriteString(*window_->Writer(), first_pos, history, {255, 255, 255});
+  window_->Paint([&](auto surface) {
+    FillRectangle(surface, draw_area.pos, draw_area.size, {0, 0, 0});
+    WriteString(surface, first_pos, history, {255, 255, 255});
+  });
   cursor_.x = linebuf_index_ + 1;
   return draw_area;
 }
 
+namespace {
+  // top の表示を更新する間隔（ターミナルに届くタイマー通知の回数）
+  const int kTopRefreshTicks = 2;
+
+  uint64_t TSCToMicroseconds(uint64_t tsc) {
+    return tsc / (tsc_freq / 1000000);
+  }
+}
+
+void Terminal::StartTop() {
+  top_running_ = true;
+  top_ticks_ = 0;
+
+  const auto start_tsc = task_manager->CollectStats().start_tsc;
+  // 最初の表示は起動時からの累計を使う
+  top_prev_ = TaskStatsSnapshot{start_tsc, start_tsc, {}};
+  DrawTop();
+}
+
+Rectangle<int> Terminal::TickTop() {
+  top_ticks_++;
+  if (top_ticks_ < kTopRefreshTicks) {
+    return {};
+  }
+  top_ticks_ = 0;
+  return DrawTop();
+}
+
+Rectangle<int> Terminal::StopTop() {
+  top_running_ = false;
+  top_prev_.tasks.clear();
+
+  FillRectangle(*window_->InnerWriter(),
+                {4, 4}, {8*kColumns, 16*kRows}, {0, 0, 0});
+  cursor_ = {0, 0};
+  Print("$ ");
+  return {ToplevelWindow::kTopLeftMargin, window_->InnerSize()};
+}
+
+/**
+ * @brief 前回の採取からの差分で各タスクの CPU 使用率と統計を描く。
+ *
+ * アイドルタスクの実行時間を除いた割合を CPU 全体の使用率とする。
+ */
+Rectangle<int> Terminal::DrawTop() {
+  auto snapshot = task_manager->CollectStats();
+
+  const uint64_t elapsed = std::max<uint64_t>(snapshot.tsc - top_prev_.tsc, 1);
+  auto prev_run_tsc = [this](uint64_t id) -> uint64_t {
+    for (const auto& e : top_prev_.tasks) {
+      if (e.id == id) {
+        return e.stats.run_tsc;
+      }
+    }
+    return 0;
+  };
+
+  uint64_t idle_permille = 0;
+  for (const auto& e : snapshot.tasks) {
+    if (e.idle) {
+      idle_permille = (e.stats.run_tsc - prev_run_tsc(e.id)) * 1000 / elapsed;
+    }
+  }
+  idle_permille = std::min<uint64_t>(idle_permille, 1000);
+
+  auto writer = window_->InnerWriter();
+  FillRectangle(*writer, {4, 4}, {8*kColumns, 16*kRows}, {0, 0, 0});
+
+  // 計数が桁数を超えて伸びても 1 行に収まるよう、行はすべて snprintf で切り詰める
+  char s[kColumns + 1];
+  int row = 0;
+  auto write_row = [&](const PixelColor& color) {
+    WriteString(*writer, {4, 4 + 16*row}, s, color);
+    row++;
+  };
+
+  const uint64_t busy_permille = 1000 - idle_permille;
+  snprintf(s, sizeof(s), "cpu %3lu.%lu%%  idle %3lu.%lu%%  tasks %lu  (any key to quit)",
+          busy_permille / 10, busy_permille % 10,
+          idle_permille / 10, idle_permille % 10,
+          snapshot.tasks.size());
+  write_row({255, 255, 255});
+  snprintf(s, sizeof(s), "  ID LV S  CPU%%  TIME(ms)    VOL  INVOL AVGLAT(us) MAX(us)");
+  write_row({0, 255, 255});
+
+  const uint64_t tsc_per_ms = tsc_freq / 1000;
+  for (const auto& e : snapshot.tasks) {
+    if (row >= kRows) {
+      break;
+    }
+    const auto& st = e.stats;
+    const uint64_t cpu_permille = std::min<uint64_t>(
+        (st.run_tsc - prev_run_tsc(e.id)) * 1000 / elapsed, 1000);
+    const uint64_t avg_latency =
+      st.wakeups == 0 ? 0 : st.wakeup_latency_sum_tsc / st.wakeups;
+    snprintf(s, sizeof(s), "%4lu %2d %c %3lu.%lu %9lu %6lu %6lu %10lu %7lu",
+            TaskSlot(e.id), e.level, e.running ? 'R' : 'S',
+            cpu_permille / 10, cpu_permille % 10,
+            st.run_tsc / tsc_per_ms,
+            st.voluntary_switches, st.involuntary_switches,
+            TSCToMicroseconds(avg_latency),
+            TSCToMicroseconds(st.wakeup_latency_max_tsc));
+    write_row({255, 255, 255});
+  }
+
+  top_prev_ = std::move(snapshot);
+  return {ToplevelWindow::kTopLeftMargin, window_->InnerSize()};
+}
+
+/**
+ * @brief trace コマンド。
+ *
+ * on / off で記録を切り替え、dump で最近のイベントを表示する。
+ * serial でリングの内容をすべてシリアルポートへ送り、stream で以降の送信を切り替える。
+ */
+void Terminal::ExecuteTrace(const char* arg) {
+  char s[64];
+  auto ring = trace_rings[0];
+
+  if (arg && strcmp(arg, "on") == 0) {
+    trace_enabled.store(true, std::memory_order_relaxed);
+  } else if (arg && strcmp(arg, "off") == 0) {
+    trace_enabled.store(false, std::memory_order_relaxed);
+  } else if (arg && strcmp(arg, "dump") == 0) {
+    const uint64_t head = ring->Head();
+    const uint64_t n = std::min<uint64_t>(head, kRows - 1);
+    TraceEvent e;
+    for (uint64_t seq = head - n; seq < head; ++seq) {
+      if (ring->Read(seq, e)) {
+        FormatTraceEvent(s, sizeof(s), e);
+        Print(s);
+      }
+    }
+  } else if (arg && strcmp(arg, "serial") == 0) {
+    const uint64_t head = ring->Head();
+    const uint64_t n = std::min<uint64_t>(head, TraceRing::kNumEvents);
+    TraceEvent e;
+    for (uint64_t seq = head - n; seq < head; ++seq) {
+      if (ring->Read(seq, e)) {
+        FormatTraceEvent(s, sizeof(s), e);
+        SerialWrite(s);
+      }
+    }
+    sprintf(s, "%lu events sent\n", n);
+    Print(s);
+  } else if (arg && strcmp(arg, "stream") == 0) {
+    trace_streaming_ = !trace_streaming_;
+    trace_stream_seq_ = ring->Head();
+    sprintf(s, "streaming %s\n", trace_streaming_ ? "on" : "off");
+    Print(s);
+  } else {
+    sprintf(s, "tracing %s, %lu events recorded\n",
+            trace_enabled.load(std::memory_order_relaxed) ? "on" : "off",
+            ring->Head());
+    Print(s);
+    Print("usage: trace on|off|dump|serial|stream\n");
+  }
+}
+
+void Terminal::StreamTrace() {
+  if (!trace_streaming_) {
+    return;
+  }
+
+  auto ring = trace_rings[0];
+  const uint64_t head = ring->Head();
+  // 送る前に上書きされた分は飛ばす
+  if (head - trace_stream_seq_ > TraceRing::kNumEvents) {
+    trace_stream_seq_ = head - TraceRing::kNumEvents;
+  }
+
+  char s[64];
+  TraceEvent e;
+  for (; trace_stream_seq_ < head; ++trace_stream_seq_) {
+    if (ring->Read(trace_stream_seq_, e)) {
+      FormatTraceEvent(s, sizeof(s), e);
+      SerialWrite(s);
+    }
+  }
+}
+
 void TaskTerminal(uint64_t task_id, int64_t data) {
-  __asm__("cli");
   Task& task = task_manager->CurrentTask();
-  Terminal* terminal = new Terminal;
-  layer_manager->Move(terminal->LayerID(), {100, 200});
-  active_layer->Activate(terminal->LayerID());
+  Terminal* terminal;
+  {
+    // レイヤーの生成と配置はメインタスクと交互に行わないようにする
+    NoPreemptionGuard guard;
+    terminal = new Terminal;
+    layer_manager->Move(terminal->LayerID(), {100, 200});
+    active_layer->Activate(terminal->LayerID());
+  }
+  layer_task_map_mutex->Lock();
   layer_task_map->insert(std::make_pair(terminal->LayerID(), task_id));
-  __asm__("sti");
+  layer_task_map_mutex->Unlock();
 
   while (true) {
-    __asm__("cli");
-    auto msg = task.ReceiveMessage();
-    if (!msg) {
-      task.Sleep();
-      __asm__("sti");
-      continue;
-    }
-    __asm__("sti");
+    auto msg = task.WaitMessage();
 
-    switch (msg->type) {
+    switch (msg.type) {
     case Message::kTimerTimeout:
       {
-        const auto area = terminal->BlinkCursor();
+        terminal->StreamTrace();
+        const auto area = terminal->TopRunning() ?
+          terminal->TickTop() : terminal->BlinkCursor();
         Message msg = MakeLayerMessage(
             task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
-        __asm__("cli");
         task_manager->SendMessage(1, msg);
-        __asm__("sti");
       }
       break;
     case Message::kKeyPush:
       {
-        const auto area = terminal->InputKey(msg->arg.keyboard.modifier,
-                                             msg->arg.keyboard.keycode,
-                                             msg->arg.keyboard.ascii);
+        const auto area = terminal->TopRunning() ?
+          terminal->StopTop() :
+          terminal->InputKey(msg.arg.keyboard.modifier,
+                             msg.arg.keyboard.keycode,
+                             msg.arg.keyboard.ascii);
         Message msg = MakeLayerMessage(
             task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
-        __asm__("cli");
         task_manager->SendMessage(1, msg);
-        __asm__("sti");
       }
       break;
     default:
+      DiscardMessage(msg);
       break;
     }
   }
@@ -23,6 +23,14 @@ class Terminal {
   Rectangle<int> BlinkCursor();
   Rectangle<int> InputKey(uint8_t modifier, uint8_t keycode, char ascii);
 
+  /** @brief top コマンドを実行中か。実行中はタイマーで表示を更新し、キー入力で終了する。 */
+  bool TopRunning() const { return top_running_; }
+  Rectangle<int> TickTop();
+  Rectangle<int> StopTop();
+
+  /** @brief trace stream で有効にした場合、前回以降のトレースをシリアルポートへ送る。 */
+  void StreamTrace();
+
  private:
   std::shared_ptr<ToplevelWindow> window_;
   unsigned int layer_id_;
@@ -44,6 +52,17 @@ class Terminal {
   std::deque<std::array<char, kLineMax>> cmd_history_{};
   int cmd_history_index_{-1};
   Rectangle<int> HistoryUpDown(int direction);
+
+  bool top_running_{false};
+  int top_ticks_{0};
+  TaskStatsSnapshot top_prev_{};
+  void StartTop();
+  Rectangle<int> DrawTop();
+
+  bool trace_streaming_{false};
+  /** @brief 次にシリアルポートへ送るトレースの通し番号 */
+  uint64_t trace_stream_seq_{0};
+  void ExecuteTrace(const char* arg);
 };
 
 void TaskTerminal(uint64_t task_id, int64_t data);
@@ -0,0 +1,55 @@
+#include "threadpool.hpp"
+
+#include "task.hpp"
+
+void TaskThreadPoolWorker(uint64_t task_id, int64_t data) {
+  reinterpret_cast<ThreadPool*>(data)->WorkerLoop();
+}
+
+ThreadPool::ThreadPool(int num_workers) {
+  for (int i = 0; i < num_workers; ++i) {
+    const uint64_t id = task_manager->NewTask()
+      .InitContext(TaskThreadPoolWorker, reinterpret_cast<int64_t>(this))
+      .Wakeup()
+      .ID();
+    workers_.push_back(id);
+  }
+}
+
+void ThreadPool::Enqueue(Job job) {
+  LockGuard guard{lock_};
+  while (jobs_.size() >= kQueueCapacity) {
+    not_full_.Wait(lock_);
+  }
+  jobs_.push_back(std::move(job));
+  not_empty_.WakeOne();
+}
+
+void ThreadPool::WorkerLoop() {
+  while (true) {
+    Job job;
+    {
+      LockGuard guard{lock_};
+      while (jobs_.empty()) {
+        not_empty_.Wait(lock_);
+      }
+      job = std::move(jobs_.front());
+      jobs_.pop_front();
+      not_full_.WakeOne();
+    }
+
+    job();
+  }
+}
+
+ThreadPool* thread_pool;
+
+int NumOnlineCPUs() {
+  // AP（BSP 以外の CPU）は起動していないので、タスクを実行できるのは BSP だけ
+  return 1;
+}
+
+void InitializeThreadPool() {
+  // 呼び出し側のタスクも処理を分担するので、ワーカーは CPU 数 - 1 個で足りる
+  thread_pool = new ThreadPool{NumOnlineCPUs() - 1};
+}
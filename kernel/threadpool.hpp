@@ -0,0 +1,186 @@
+/**
+ * @file threadpool.hpp
+ *
+ * 独立した処理をワーカータスクに分配して並行に実行するスレッドプールを提供する。
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "spinlock.hpp"
+#include "sync.hpp"
+
+/** @brief Future と実行側で共有する完了状態 */
+class FutureStateBase {
+ public:
+  bool Ready() {
+    LockGuard guard{lock_};
+    return ready_;
+  }
+
+  /** @brief 完了するまで眠って待つ。 */
+  void Wait() {
+    LockGuard guard{lock_};
+    while (!ready_) {
+      waiters_.Wait(lock_);
+    }
+  }
+
+ protected:
+  /** @brief f を lock_ を保持した状態で呼んで結果を格納し、待っているタスクを起こす。 */
+  template <class F>
+  void Complete(F f) {
+    LockGuard guard{lock_};
+    f();
+    ready_ = true;
+    waiters_.WakeAll();
+  }
+
+ private:
+  SpinLock lock_;
+  WaitQueue waiters_;
+  bool ready_{false};
+};
+
+template <class T>
+class FutureState : public FutureStateBase {
+ public:
+  void SetValue(T value) {
+    Complete([&]{ value_.emplace(std::move(value)); });
+  }
+  T& Value() { return *value_; }
+
+ private:
+  std::optional<T> value_;
+};
+
+template <>
+class FutureState<void> : public FutureStateBase {
+ public:
+  void SetValue() { Complete([]{}); }
+};
+
+/** @brief ThreadPool::Submit で投入した処理の結果を受け取る。 */
+template <class T>
+class Future {
+ public:
+  Future() = default;
+  explicit Future(std::shared_ptr<FutureState<T>> state) : state_{std::move(state)} {}
+
+  bool Valid() const { return static_cast<bool>(state_); }
+  bool Ready() const { return state_->Ready(); }
+  void Wait() const { state_->Wait(); }
+
+  /** @brief 処理が終わるまで待ち、結果を返す。 */
+  T Get() {
+    state_->Wait();
+    if constexpr (!std::is_void_v<T>) {
+      return std::move(state_->Value());
+    }
+  }
+
+ private:
+  std::shared_ptr<FutureState<T>> state_;
+};
+
+/** @brief 決まった数のワーカータスクで処理を実行する。
+ *
+ * 待ち行列は有限で、満杯なら Submit は空きができるまで眠る。
+ * ワーカーが 0 個のときは、Submit や ParallelFor は呼び出し側でその場で実行する。
+ * 処理の中で割り込みを禁止したまま眠ってはならない。
+ */
+class ThreadPool {
+ public:
+  static const size_t kQueueCapacity = 64;
+
+  explicit ThreadPool(int num_workers);
+  int NumWorkers() const { return workers_.size(); }
+
+  /** @brief f() を実行するよう投入し、その結果を受け取る Future を返す。 */
+  template <class F>
+  Future<std::invoke_result_t<F>> Submit(F f) {
+    using T = std::invoke_result_t<F>;
+    auto state = std::make_shared<FutureState<T>>();
+    auto job = [f = std::move(f), state]() mutable {
+      if constexpr (std::is_void_v<T>) {
+        f();
+        state->SetValue();
+      } else {
+        state->SetValue(f());
+      }
+    };
+
+    if (workers_.empty()) {
+      job();
+    } else {
+      Enqueue(std::move(job));
+    }
+    return Future<T>{state};
+  }
+
+  /** @brief [begin, end) の各 i について fn(i) を実行し、すべて終わるまで待つ。
+   *
+   * 範囲をワーカー数 + 1 個に分割し、1 つは呼び出し側のタスクで実行する。
+   */
+  template <class F>
+  void ParallelFor(int begin, int end, F fn) {
+    const int n = end - begin;
+    if (n <= 0) {
+      return;
+    }
+
+    const int num_chunks = std::min<int>(NumWorkers() + 1, n);
+    if (num_chunks == 1) {
+      for (int i = begin; i < end; ++i) {
+        fn(i);
+      }
+      return;
+    }
+
+    const int chunk = (n + num_chunks - 1) / num_chunks;
+    std::vector<Future<void>> futures;
+    for (int lo = begin + chunk; lo < end; lo += chunk) {
+      const int hi = std::min(lo + chunk, end);
+      futures.push_back(Submit([&fn, lo, hi]{
+        for (int i = lo; i < hi; ++i) {
+          fn(i);
+        }
+      }));
+    }
+
+    for (int i = begin; i < begin + chunk; ++i) {
+      fn(i);
+    }
+    for (auto& f : futures) {
+      f.Wait();
+    }
+  }
+
+ private:
+  using Job = std::function<void ()>;
+
+  SpinLock lock_;
+  std::deque<Job> jobs_{};
+  WaitQueue not_empty_, not_full_;
+  std::vector<uint64_t> workers_{};
+
+  void Enqueue(Job job);
+  [[noreturn]] void WorkerLoop();
+
+  friend void TaskThreadPoolWorker(uint64_t task_id, int64_t data);
+};
+
+extern ThreadPool* thread_pool;
+
+/** @brief タスクを実行できる CPU の数 */
+int NumOnlineCPUs();
+
+void InitializeThreadPool();
@@ -1,6 +1,11 @@
 #include "timer.hpp"
 
+#include <algorithm>
+
 #include "acpi.hpp"
+#include "asmfunc.h"
+#include "coro.hpp"
+#include "hpet.hpp"
 #include "interrupt.hpp"
 #include "task.hpp"
 
@@ -18,12 +23,19 @@ void InitializeLAPICTimer() {
   divide_config = 0b1011;
   lvt_timer = 0b001 << 16;
 
+  const auto tsc_start = ReadTSC();
   StartLAPICTimer();
-  acpi::WaitMilliseconds(100);
+  if (hpet) {
+    hpet->WaitMilliseconds(100);
+  } else {
+    acpi::WaitMilliseconds(100);
+  }
   const auto elapsed = LAPICTimerElapsed();
   StopLAPICTimer();
+  const auto tsc_end = ReadTSC();
 
   lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+  tsc_freq = (tsc_end - tsc_start) * 10;
 
   divide_config = 0b1011;
   lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer;
@@ -42,41 +54,84 @@ void StopLAPICTimer() {
   initial_count = 0;
 }
 
-Timer::Timer(unsigned long timeout, int value)
-    : timeout_{timeout}, value_{value} {
+Timer::Timer(unsigned long timeout, int value, uint64_t task_id)
+    : timeout_{timeout}, value_{value}, task_id_{task_id} {
 }
 
 TimerManager::TimerManager() {
-  timers_.push(Timer{std::numeric_limits<unsigned long>::max(), -1});
+  PushLocked(Timer{std::numeric_limits<unsigned long>::max(), -1});
+}
+
+uint64_t TimerManager::AddTimer(const Timer& timer) {
+  LockGuard guard{lock_};
+  Timer t = timer;
+  t.id_ = next_timer_id_++;
+  PushLocked(t);
+  return t.id_;
+}
+
+bool TimerManager::CancelTimer(uint64_t id) {
+  if (id == 0) {
+    // 0 は AddTimer を経ずに積んだ内部のタイマー（番兵やタスク切り替え用）の番号
+    return false;
+  }
+  LockGuard guard{lock_};
+  auto it = std::find_if(timers_.begin(), timers_.end(),
+                         [id](const Timer& t) { return t.ID() == id; });
+  if (it == timers_.end()) {
+    return false;
+  }
+  timers_.erase(it);
+  std::make_heap(timers_.begin(), timers_.end());
+  return true;
 }
 
-void TimerManager::AddTimer(const Timer& timer) {
-  timers_.push(timer);
+void TimerManager::PushLocked(Timer timer) {
+  timers_.push_back(timer);
+  std::push_heap(timers_.begin(), timers_.end());
+}
+
+void TimerManager::PopLocked() {
+  std::pop_heap(timers_.begin(), timers_.end());
+  timers_.pop_back();
 }
 
 bool TimerManager::Tick() {
-  tick_++;
+  LockGuard guard{lock_};
+  tick_ = tick_ + 1;
 
   bool task_timer_timeout = false;
   while (true) {
-    const auto& t = timers_.top();
+    const Timer t = timers_.front();
     if (t.Timeout() > tick_) {
       break;
     }
 
     if (t.Value() == kTaskTimerValue) {
       task_timer_timeout = true;
-      timers_.pop();
-      timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue});
+      PopLocked();
+      PushLocked(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue});
+      continue;
+    }
+
+    if (t.Value() == kWakeupTimerValue) {
+      task_manager->Wakeup(t.TaskID());
+      PopLocked();
+      continue;
+    }
+
+    if (t.Value() == kCoroutineTimerValue) {
+      coro::executor->OnTimer(t.Timeout());
+      PopLocked();
       continue;
     }
 
     Message m{Message::kTimerTimeout};
     m.arg.timer.timeout = t.Timeout();
     m.arg.timer.value = t.Value();
-    task_manager->SendMessage(1, m);
+    task_manager->SendMessage(t.TaskID(), m);
 
-    timers_.pop();
+    PopLocked();
   }
 
   return task_timer_timeout;
@@ -84,12 +139,13 @@ bool TimerManager::Tick() {
 
 TimerManager* timer_manager;
 unsigned long lapic_timer_freq;
+unsigned long tsc_freq;
 
 void LAPICTimerOnInterrupt() {
   const bool task_timer_timeout = timer_manager->Tick();
   NotifyEndOfInterrupt();
 
-  if (task_timer_timeout) {
+  if (task_timer_timeout || task_manager->ReschedulePending()) {
     task_manager->SwitchTask();
   }
 }
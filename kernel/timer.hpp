@@ -1,10 +1,10 @@
 #pragma once
 
 #include <cstdint>
-#include <queue>
 #include <vector>
 #include <limits>
 #include "message.hpp"
+#include "spinlock.hpp"
 
 void InitializeLAPICTimer();
 void StartLAPICTimer();
@@ -13,13 +13,21 @@ void StopLAPICTimer();
 
 class Timer {
  public:
-  Timer(unsigned long timeout, int value);
+  Timer(unsigned long timeout, int value, uint64_t task_id = 1);
   unsigned long Timeout() const { return timeout_; }
   int Value() const { return value_; }
+  /** @brief タイムアウトを通知する（kWakeupTimerValue なら起床させる）タスク */
+  uint64_t TaskID() const { return task_id_; }
+  /** @brief TimerManager::AddTimer が割り当てる、タイマーを取り消すための番号 */
+  uint64_t ID() const { return id_; }
  
  private:
   unsigned long timeout_;
   int value_;
+  uint64_t task_id_;
+  uint64_t id_{0};
+
+  friend class TimerManager;
 };
 
 /** @brief タイマー優先度を比較する。タイムアウトが遠いほど優先度が低い。*/
@@ -30,20 +38,39 @@ inline bool operator<(const Timer& lhs, const Timer& rhs) {
 class TimerManager {
  public:
   TimerManager();
-  void AddTimer(const Timer& timer);
+  /** @brief タイマーを登録し、CancelTimer に渡す番号を返す。 */
+  uint64_t AddTimer(const Timer& timer);
+  /** @brief まだ満了していないタイマーを取り消す。
+   *
+   * @return 取り消せたら true、すでに満了していた（あるいは存在しない）なら false
+   */
+  bool CancelTimer(uint64_t id);
   bool Tick();
   unsigned long CurrentTick() const { return tick_; }
  
  private:
   volatile unsigned long tick_{0};
-  std::priority_queue<Timer> timers_{};
+  /** @brief timers_ を保護する。tick_ は割り込みハンドラだけが書き換えるので読み出しには不要。 */
+  SpinLock lock_;
+  /** @brief タイムアウトが最も近いタイマーを先頭とするヒープ。取り消しのため priority_queue ではなく vector で持つ。 */
+  std::vector<Timer> timers_{};
+  uint64_t next_timer_id_{1};
+
+  void PushLocked(Timer timer);
+  void PopLocked();
 };
 
 extern TimerManager* timer_manager;
 extern unsigned long lapic_timer_freq;
+/** @brief TSC の 1 秒あたりのカウント数（LAPIC タイマーと同時に較正する） */
+extern unsigned long tsc_freq;
 const int kTimerFreq = 100;
 
 const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
 const int kTaskTimerValue = std::numeric_limits<int>::min();
+/** @brief この値のタイマーはメッセージを送らず、TaskID() のタスクを直接起床させる。 */
+const int kWakeupTimerValue = std::numeric_limits<int>::min() + 1;
+/** @brief この値のタイマーは coro::Executor に満了を通知し、眠っているコルーチンを再開させる。 */
+const int kCoroutineTimerValue = std::numeric_limits<int>::min() + 2;
 
 void LAPICTimerOnInterrupt();
@@ -0,0 +1,63 @@
+#include "trace.hpp"
+
+#include <cstdio>
+
+#include "asmfunc.h"
+#include "timer.hpp"
+
+void TraceRing::Record(TraceEventType type, uint64_t from, uint64_t to,
+                       uint8_t reason, uint8_t level) {
+  const uint64_t seq = head_.fetch_add(1, std::memory_order_relaxed);
+  auto& e = events_[seq % kNumEvents];
+  // 書き込み中のイベントを読み手が使わないよう、先に通し番号を無効にしておく
+  e.seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  e.tsc = ReadTSC();
+  e.from = from;
+  e.to = to;
+  e.type = type;
+  e.reason = reason;
+  e.level = level;
+  e.seq.store(seq + 1, std::memory_order_release);
+}
+
+bool TraceRing::Read(uint64_t seq, TraceEvent& event) const {
+  const auto& e = events_[seq % kNumEvents];
+  if (e.seq.load(std::memory_order_acquire) != seq + 1) {
+    return false;
+  }
+  event.tsc = e.tsc;
+  event.from = e.from;
+  event.to = e.to;
+  event.type = e.type;
+  event.reason = e.reason;
+  event.level = e.level;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  // 読んでいる間に上書きされていたら捨てる
+  return e.seq.load(std::memory_order_relaxed) == seq + 1;
+}
+
+std::atomic<bool> trace_enabled{false};
+std::array<TraceRing*, kMaxTraceCPUs> trace_rings;
+
+namespace {
+  uint64_t trace_start_tsc;
+}
+
+void FormatTraceEvent(char* buf, size_t size, const TraceEvent& event) {
+  static const char* const kTypeNames[] = {
+    "switch", "wakeup", "sleep", "msg", "exit",
+  };
+  const uint64_t us = (event.tsc - trace_start_tsc) / (tsc_freq / 1000000);
+  snprintf(buf, size, "%10lu.%06lu %-6s %3u -> %3u lv%u r%u\n",
+           us / 1000000, us % 1000000,
+           kTypeNames[static_cast<int>(event.type)],
+           event.from, event.to, event.level, event.reason);
+}
+
+void InitializeTrace() {
+  trace_start_tsc = ReadTSC();
+  for (auto& ring : trace_rings) {
+    ring = new TraceRing;
+  }
+}
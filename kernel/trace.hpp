@@ -0,0 +1,81 @@
+/**
+ * @file trace.hpp
+ *
+ * スケジューラのイベントを記録するトレース用のリングバッファ。
+ *
+ * タスクの切り替え、起床、スリープ、メッセージ送信を固定長のバイナリで記録する。
+ * 記録はロックを取らず、CPU ごとのリングに書き込む。
+ * トレースが無効なときの記録のコストはフラグを 1 回読むだけである。
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+enum class TraceEventType : uint8_t {
+  kSwitch,
+  kWakeup,
+  kSleep,
+  kSendMessage,
+  kExit,
+};
+
+/** @brief kSwitch イベントの reason */
+enum TraceSwitchReason : uint8_t {
+  kTraceSwitchSleep,
+  kTraceSwitchPreempt,
+};
+
+/** @brief 1 件のイベント。from はイベントを起こしたタスク、to は対象のタスク。 */
+struct TraceEvent {
+  /** @brief リング上の通し番号 + 1。書き込みの途中や未使用なら期待値と一致しない。 */
+  std::atomic<uint64_t> seq;
+  uint64_t tsc;
+  uint32_t from, to;
+  TraceEventType type;
+  /** @brief kSwitch なら TraceSwitchReason、kSendMessage なら Message::Type */
+  uint8_t reason;
+  /** @brief 対象のタスクのレベル */
+  uint8_t level;
+};
+
+/** @brief 書き込み側はロックを取らない、上書き型のリングバッファ */
+class TraceRing {
+ public:
+  static const size_t kNumEvents = 4096;
+
+  void Record(TraceEventType type, uint64_t from, uint64_t to,
+              uint8_t reason, uint8_t level);
+
+  /** @brief 通し番号 seq のイベントを読む。すでに上書きされたか書き込み中なら false を返す。 */
+  bool Read(uint64_t seq, TraceEvent& event) const;
+  /** @brief 次に書き込まれるイベントの通し番号 */
+  uint64_t Head() const { return head_.load(std::memory_order_acquire); }
+
+ private:
+  std::atomic<uint64_t> head_{0};
+  std::array<TraceEvent, kNumEvents> events_{};
+};
+
+/** @brief トレースを記録する CPU の最大数。現在は BSP のみ */
+const int kMaxTraceCPUs = 1;
+
+extern std::atomic<bool> trace_enabled;
+extern std::array<TraceRing*, kMaxTraceCPUs> trace_rings;
+
+/** @brief トレースが有効ならイベントを記録する。 */
+inline void Trace(TraceEventType type, uint64_t from, uint64_t to,
+                  uint8_t reason, uint8_t level) {
+  if (__builtin_expect(trace_enabled.load(std::memory_order_relaxed), false)) {
+    // AP は起動していないので、記録するのは常に BSP のリング
+    trace_rings[0]->Record(type, from, to, reason, level);
+  }
+}
+
+/** @brief イベントを改行付きの 1 行の文字列にする。時刻は InitializeTrace からの経過時間で表す。 */
+void FormatTraceEvent(char* buf, size_t size, const TraceEvent& event);
+
+void InitializeTrace();
@@ -8,6 +8,7 @@
 #include "usb/device.hpp"
 #include "usb/descriptor.hpp"
 #include "usb/xhci/speed.hpp"
+#include "coro.hpp"
 
 namespace {
   using namespace usb::xhci;
@@ -22,28 +23,85 @@ namespace {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  enum class ConfigPhase {
-    kNotConnected,
-    kWaitingAddressed,
-    kResettingPort,
-    kEnablingSlot,
-    kAddressingDevice,
-    kInitializingDevice,
-    kConfiguringEndpoints,
-    kConfigured,
-  };
   /* root hub port はリセット処理をしてからアドレスを割り当てるまでは
    * 他の処理を挟まず，そのポートについての処理だけをしなければならない．
-   * kWaitingAddressed はリセット（kResettingPort）からアドレス割り当て
-   * （kAddressingDevice）までの一連の処理の実行を待っている状態．
+   * addressing_mutex はリセットからアドレス割り当てまでの一連の処理を
+   * 1 ポートずつに制限する．
    */
+  coro::Mutex* addressing_mutex;
+
+  /** 設定処理のコルーチンが動いているポート． index: port number */
+  std::array<bool, 256> port_configuring{};
+  /** Port Status Change Event を待っているコルーチン． index: port number */
+  std::array<coro::coroutine_handle<>, 256> port_waiters{};
+  /** デバイスの初期化（ディスクリプタの取得など）の完了を待っているコルーチン． index: slot id */
+  std::array<coro::coroutine_handle<>, 256> slot_init_waiters{};
+
+  /** 完了を待っているコマンド．trb はコマンドリング上の TRB を指す． */
+  struct PendingCommand {
+    TRB* trb;
+    coro::coroutine_handle<> waiter;
+    CommandCompletionEventTRB* result;
+  };
+  std::array<PendingCommand, 32> pending_commands{};
 
-  std::array<volatile ConfigPhase, 256> port_config_phase{};  // index: port number
-
-  /** kResettingPort から kAddressingDevice までの処理を実行中のポート番号．
-   * 0 ならその状態のポートがないことを示す．
+  /** @brief コマンドをコマンドリングに積み，その Command Completion Event を待つ．
+   *
+   * 空きがなくて発行できなければ，完了コードが 0（Invalid）のイベントを返す．
    */
-  uint8_t addressing_port{0};
+  template <class CommandTRB>
+  auto IssueCommand(Controller& xhc, const CommandTRB& cmd) {
+    struct Awaiter {
+      Controller& xhc;
+      CommandTRB cmd;
+      CommandCompletionEventTRB result{};
+
+      bool await_ready() const noexcept { return false; }
+      bool await_suspend(coro::coroutine_handle<> h) {
+        for (auto& pending : pending_commands) {
+          if (pending.trb == nullptr) {
+            pending = {xhc.CommandRing()->Push(cmd), h, &result};
+            xhc.DoorbellRegisterAt(0)->Ring(0);
+            return true;
+          }
+        }
+        result.bits.completion_code = 0;
+        return false;
+      }
+      CommandCompletionEventTRB await_resume() const { return result; }
+    };
+    return Awaiter{xhc, cmd};
+  }
+
+  /** @brief 指定したポートの Port Status Change Event を待つ． */
+  auto PortStatusChange(uint8_t port_id) {
+    struct Awaiter {
+      uint8_t port_id;
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(coro::coroutine_handle<> h) { port_waiters[port_id] = h; }
+      void await_resume() const noexcept {}
+    };
+    return Awaiter{port_id};
+  }
+
+  /** @brief デバイスのディスクリプタ取得などの初期化が終わるのを待つ． */
+  auto DeviceInitialized(Device& dev) {
+    struct Awaiter {
+      Device& dev;
+      bool await_ready() { return dev.IsInitialized(); }
+      void await_suspend(coro::coroutine_handle<> h) { slot_init_waiters[dev.SlotID()] = h; }
+      void await_resume() const noexcept {}
+    };
+    return Awaiter{dev};
+  }
+
+  Error CheckCompletion(const CommandCompletionEventTRB& trb) {
+    if (trb.bits.completion_code != 1) { // 1: Success
+      Log(kError, "command failed: completion code = %d\n", trb.bits.completion_code);
+      return MAKE_ERROR(Error::kTransferFailed);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
 
   void InitializeSlotContext(SlotContext& ctx, Port& port) {
     ctx.bits.route_string = 0;
@@ -88,57 +146,15 @@ namespace {
     ctx.bits.error_count = 3;
   }
 
-  Error ResetPort(Controller& xhc, Port& port) {
-    const bool is_connected = port.IsConnected();
-    Log(kDebug, "ResetPort: port.IsConnected() = %s\n",
-        is_connected ? "true" : "false");
-
-    if (!is_connected) {
-      return MAKE_ERROR(Error::kSuccess);
-    }
-
-    if (addressing_port != 0) {
-      port_config_phase[port.Number()] = ConfigPhase::kWaitingAddressed;
-    } else {
-      const auto port_phase = port_config_phase[port.Number()];
-      if (port_phase != ConfigPhase::kNotConnected &&
-          port_phase != ConfigPhase::kWaitingAddressed) {
-        return MAKE_ERROR(Error::kInvalidPhase);
-      }
-      addressing_port = port.Number();
-      port_config_phase[port.Number()] = ConfigPhase::kResettingPort;
-      port.Reset();
-    }
-    return MAKE_ERROR(Error::kSuccess);
-  }
-
-  Error EnableSlot(Controller& xhc, Port& port) {
-    const bool is_enabled = port.IsEnabled();
-    const bool reset_completed = port.IsPortResetChanged();
-    Log(kDebug, "EnableSlot: port.IsEnabled() = %s, port.IsPortResetChanged() = %s\n",
-        is_enabled ? "true" : "false",
-        reset_completed ? "true" : "false");
-
-    if (is_enabled && reset_completed) {
-      port.ClearPortResetChange();
-
-      port_config_phase[port.Number()] = ConfigPhase::kEnablingSlot;
-
-      EnableSlotCommandTRB cmd{};
-      xhc.CommandRing()->Push(cmd);
-      xhc.DoorbellRegisterAt(0)->Ring(0);
-    }
-    return MAKE_ERROR(Error::kSuccess);
-  }
-
-  Error AddressDevice(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
+  /** @brief Address Device コマンドに渡す Input Context を準備する． */
+  WithError<Device*> PrepareAddressDevice(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
     Log(kDebug, "AddressDevice: port_id = %d, slot_id = %d\n", port_id, slot_id);
 
     xhc.DeviceManager()->AllocDevice(slot_id, xhc.DoorbellRegisterAt(slot_id));
 
     Device* dev = xhc.DeviceManager()->FindBySlot(slot_id);
     if (dev == nullptr) {
-      return MAKE_ERROR(Error::kInvalidSlotID);
+      return {nullptr, MAKE_ERROR(Error::kInvalidSlotID)};
     }
 
     memset(&dev->InputContext()->input_control_context, 0,
@@ -156,57 +172,100 @@ namespace {
         DetermineMaxPacketSizeForControlPipe(slot_ctx->bits.speed));
 
     xhc.DeviceManager()->LoadDCBAA(slot_id);
-
-    port_config_phase[port_id] = ConfigPhase::kAddressingDevice;
-
-    AddressDeviceCommandTRB addr_dev_cmd{dev->InputContext(), slot_id};
-    xhc.CommandRing()->Push(addr_dev_cmd);
-    xhc.DoorbellRegisterAt(0)->Ring(0);
-
-    return MAKE_ERROR(Error::kSuccess);
+    return {dev, MAKE_ERROR(Error::kSuccess)};
   }
 
-  Error InitializeDevice(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
-    Log(kDebug, "InitializeDevice: port_id = %d, slot_id = %d\n", port_id, slot_id);
+  /** @brief ポートをリセットし，スロットの割り当てとアドレスの割り当てまでを行う．
+   *
+   * 呼び出し側は addressing_mutex を取得しておくこと．
+   */
+  coro::Task<WithError<Device*>> AddressPort(Controller& xhc, uint8_t port_id) {
+    auto port = xhc.PortAt(port_id);
+    const bool is_connected = port.IsConnected();
+    Log(kDebug, "ResetPort: port.IsConnected() = %s\n",
+        is_connected ? "true" : "false");
+    if (!is_connected) {
+      co_return WithError<Device*>{nullptr, MAKE_ERROR(Error::kPortNotConnected)};
+    }
+
+    port.Reset();
+    while (true) {
+      co_await PortStatusChange(port_id);
+      const bool is_enabled = port.IsEnabled();
+      const bool reset_completed = port.IsPortResetChanged();
+      Log(kDebug, "EnableSlot: port.IsEnabled() = %s, port.IsPortResetChanged() = %s\n",
+          is_enabled ? "true" : "false",
+          reset_completed ? "true" : "false");
+      if (is_enabled && reset_completed) {
+        break;
+      }
+    }
+    port.ClearPortResetChange();
 
-    auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
-    if (dev == nullptr) {
-      return MAKE_ERROR(Error::kInvalidSlotID);
+    const auto slot_event = co_await IssueCommand(xhc, EnableSlotCommandTRB{});
+    if (auto err = CheckCompletion(slot_event)) {
+      co_return WithError<Device*>{nullptr, err};
     }
+    const uint8_t slot_id = slot_event.bits.slot_id;
 
-    port_config_phase[port_id] = ConfigPhase::kInitializingDevice;
-    dev->StartInitialize();
+    const auto dev = PrepareAddressDevice(xhc, port_id, slot_id);
+    if (dev.error) {
+      co_return dev;
+    }
 
-    return MAKE_ERROR(Error::kSuccess);
+    const auto addr_event = co_await IssueCommand(
+        xhc, AddressDeviceCommandTRB{dev.value->InputContext(), slot_id});
+    if (auto err = CheckCompletion(addr_event)) {
+      co_return WithError<Device*>{nullptr, err};
+    }
+    co_return dev;
   }
 
-  Error CompleteConfiguration(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
-    Log(kDebug, "CompleteConfiguration: port_id = %d, slot_id = %d\n", port_id, slot_id);
+  /** @brief 接続されたポートのデバイスを使える状態にするまでの一連の処理． */
+  coro::Task<void> ConfigurePortAsync(Controller& xhc, uint8_t port_id) {
+    co_await addressing_mutex->Lock();
+    const auto addressed = co_await AddressPort(xhc, port_id);
+    addressing_mutex->Unlock();
 
-    auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
-    if (dev == nullptr) {
-      return MAKE_ERROR(Error::kInvalidSlotID);
+    Device* dev = addressed.value;
+    Error err = addressed.error;
+    if (!err) {
+      Log(kDebug, "InitializeDevice: port_id = %d, slot_id = %d\n", port_id, dev->SlotID());
+      err = dev->StartInitialize();
+    }
+    if (!err) {
+      co_await DeviceInitialized(*dev);
+      err = ConfigureEndpoints(xhc, *dev);
+    }
+    if (!err) {
+      const auto event = co_await IssueCommand(
+          xhc, ConfigureEndpointCommandTRB{dev->InputContext(), dev->SlotID()});
+      err = CheckCompletion(event);
+    }
+    if (!err) {
+      Log(kDebug, "CompleteConfiguration: port_id = %d, slot_id = %d\n",
+          port_id, dev->SlotID());
+      err = dev->OnEndpointsConfigured();
     }
 
-    dev->OnEndpointsConfigured();
-
-    port_config_phase[port_id] = ConfigPhase::kConfigured;
-    return MAKE_ERROR(Error::kSuccess);
+    if (err) {
+      Log(kError, "failed to configure port %d: %s at %s:%d\n",
+          port_id, err.Name(), err.File(), err.Line());
+    }
+    port_configuring[port_id] = false;
   }
 
   Error OnEvent(Controller& xhc, PortStatusChangeEventTRB& trb) {
     Log(kDebug, "PortStatusChangeEvent: port_id = %d\n", trb.bits.port_id);
     auto port_id = trb.bits.port_id;
-    auto port = xhc.PortAt(port_id);
 
-    switch (port_config_phase[port_id]) {
-    case ConfigPhase::kNotConnected:
-      return ResetPort(xhc, port);
-    case ConfigPhase::kResettingPort:
-      return EnableSlot(xhc, port);
-    default:
-      return MAKE_ERROR(Error::kInvalidPhase);
+    if (auto waiter = std::exchange(port_waiters[port_id], {})) {
+      coro::executor->Schedule(waiter);
+      return MAKE_ERROR(Error::kSuccess);
     }
+
+    auto port = xhc.PortAt(port_id);
+    return ConfigurePort(xhc, port);
   }
 
   Error OnEvent(Controller& xhc, TransferEventTRB& trb) {
@@ -219,68 +278,29 @@ namespace {
       return err;
     }
 
-    const auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
-    if (dev->IsInitialized() &&
-        port_config_phase[port_id] == ConfigPhase::kInitializingDevice) {
-      return ConfigureEndpoints(xhc, *dev);
+    if (dev->IsInitialized()) {
+      if (auto waiter = std::exchange(slot_init_waiters[slot_id], {})) {
+        coro::executor->Schedule(waiter);
+      }
     }
     return MAKE_ERROR(Error::kSuccess);
   }
 
   Error OnEvent(Controller& xhc, CommandCompletionEventTRB& trb) {
     const auto issuer_type = trb.Pointer()->bits.trb_type;
-    const auto slot_id = trb.bits.slot_id;
     Log(kDebug, "CommandCompletionEvent: slot_id = %d, issuer = %s\n",
         trb.bits.slot_id, kTRBTypeToName[issuer_type]);
 
-    if (issuer_type == EnableSlotCommandTRB::Type) {
-      if (port_config_phase[addressing_port] != ConfigPhase::kEnablingSlot) {
-        return MAKE_ERROR(Error::kInvalidPhase);
-      }
-
-      return AddressDevice(xhc, addressing_port, slot_id);
-    } else if (issuer_type == AddressDeviceCommandTRB::Type) {
-      auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
-      if (dev == nullptr) {
-        return MAKE_ERROR(Error::kInvalidSlotID);
-      }
-
-      auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
-
-      if (port_id != addressing_port) {
-        return MAKE_ERROR(Error::kInvalidPhase);
-      }
-      if (port_config_phase[port_id] != ConfigPhase::kAddressingDevice) {
-        return MAKE_ERROR(Error::kInvalidPhase);
-      }
-
-      addressing_port = 0;
-      for (int i = 0; i < port_config_phase.size(); ++i) {
-        if (port_config_phase[i] == ConfigPhase::kWaitingAddressed) {
-          auto port = xhc.PortAt(i);
-          if (auto err = ResetPort(xhc, port); err) {
-            return err;
-          }
-          break;
-        }
+    for (auto& pending : pending_commands) {
+      if (pending.trb == trb.Pointer()) {
+        *pending.result = trb;
+        coro::executor->Schedule(pending.waiter);
+        pending = {};
+        return MAKE_ERROR(Error::kSuccess);
       }
-
-      return InitializeDevice(xhc, port_id, slot_id);
-    } else if (issuer_type == ConfigureEndpointCommandTRB::Type) {
-      auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
-      if (dev == nullptr) {
-        return MAKE_ERROR(Error::kInvalidSlotID);
-      }
-
-      auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
-      if (port_config_phase[port_id] != ConfigPhase::kConfiguringEndpoints) {
-        return MAKE_ERROR(Error::kInvalidPhase);
-      }
-
-      return CompleteConfiguration(xhc, port_id, slot_id);
     }
 
-    return MAKE_ERROR(Error::kInvalidPhase);
+    return MAKE_ERROR(Error::kNoWaiter);
   }
 
   void RequestHCOwnership(uintptr_t mmio_base, HCCPARAMS1_Bitmap hccp) {
@@ -438,9 +458,11 @@ namespace usb::xhci {
   }
 
   Error ConfigurePort(Controller& xhc, Port& port) {
-    if (port_config_phase[port.Number()] == ConfigPhase::kNotConnected) {
-      return ResetPort(xhc, port);
+    if (!port.IsConnected() || port_configuring[port.Number()]) {
+      return MAKE_ERROR(Error::kSuccess);
     }
+    port_configuring[port.Number()] = true;
+    coro::executor->Spawn(ConfigurePortAsync(xhc, port.Number()));
     return MAKE_ERROR(Error::kSuccess);
   }
 
@@ -500,12 +522,6 @@ namespace usb::xhci {
       ep_ctx->bits.error_count = 3;
     }
 
-    port_config_phase[port_id] = ConfigPhase::kConfiguringEndpoints;
-
-    ConfigureEndpointCommandTRB cmd{dev.InputContext(), dev.SlotID()};
-    xhc.CommandRing()->Push(cmd);
-    xhc.DoorbellRegisterAt(0)->Ring(0);
-
     return MAKE_ERROR(Error::kSuccess);
   }
 
@@ -568,6 +584,7 @@ namespace usb::xhci {
     Log(kDebug, "xHC mmio_base = %08lx\n", xhc_mmio_base);
 
     usb::xhci::controller = new Controller{xhc_mmio_base};
+    addressing_mutex = new coro::Mutex;
     Controller& xhc = *usb::xhci::controller;
 
     if (0x8086 == pci::ReadVendorId(*xhc_dev)) {
@@ -25,11 +25,6 @@ namespace {
 
 Window::Window(int width, int height, PixelFormat shadow_format)
     : width_{width}, height_{height} {
-  data_.resize(height);
-  for (int y = 0; y < height; y++) {
-    data_[y].resize(width);
-  }
-
   FrameBufferConfig config{};
   config.frame_buffer = nullptr;
   config.horizontal_resolution = width;
@@ -42,47 +37,139 @@ Window::Window(int width, int height, PixelFormat shadow_format)
   }
 }
 
-void Window::DrawTo(FrameBuffer& dst, Vector2D<int> pos, const Rectangle<int>& area) {
-  if (!transparent_color_) {
+void Window::DrawTo(FrameBuffer& dst, Vector2D<int> pos, const Rectangle<int>& area,
+                    uint8_t opacity) {
+  if (IsOpaque() && opacity == 255) {
     Rectangle<int> window_area{pos, Size()};
     Rectangle<int> intersection = area & window_area;
     dst.Copy(intersection.pos, shadow_buffer_, {intersection.pos - pos, intersection.size});
     return;
   }
 
-  const auto tc = transparent_color_.value();
-  auto& writer = dst.Writer();
-  for (int y = std::max(0, 0 - pos.y);
-       y < std::min(Height(), writer.Height() - pos.y);
-       y++) {
-    for (int x = std::max(0, 0 - pos.x);
-        x < std::min(Width(), writer.Width() - pos.x);
-        x++) {
-      const auto c = At(Vector2D<int>{x, y});
-      if (c != tc) {
-        writer.Write(pos + Vector2D<int>{x, y}, c);
+  if (dst.Config().pixel_format != shadow_buffer_.Config().pixel_format) {
+    return;
+  }
+
+  // area と描画先とウィンドウの共通部分だけを描く
+  const Rectangle<int> dst_outline{{0, 0}, {dst.Writer().Width(), dst.Writer().Height()}};
+  const auto clip = area & dst_outline & Rectangle<int>{pos, Size()};
+  const int x_begin = clip.pos.x - pos.x;
+  const int x_end = x_begin + clip.size.x;
+  const int y_begin = clip.pos.y - pos.y;
+  const int y_end = y_begin + clip.size.y;
+  if (x_begin >= x_end) {
+    return;
+  }
+
+  if (IsOpaque()) {
+    // 不透明なウィンドウをレイヤーの不透明度で重ねる
+    for (int y = y_begin; y < y_end; y++) {
+      BlendPixels32(dst.RowAt(pos.y + y) + pos.x + x_begin, shadow_buffer_.RowAt(y) + x_begin,
+                    x_end - x_begin, opacity, true);
+    }
+    return;
+  }
+
+  if (runs_dirty_) {
+    UpdateRuns();
+  }
+
+  // 完全に不透明な区間はそのままコピーし、半透明な区間だけを合成する
+  for (int y = y_begin; y < y_end; y++) {
+    const uint32_t* src_row = shadow_buffer_.RowAt(y);
+    uint32_t* dst_row = dst.RowAt(pos.y + y) + pos.x;
+    for (int i = row_runs_begin_[y]; i < row_runs_begin_[y + 1]; i++) {
+      const auto& run = runs_[i];
+      const int begin = std::max<int>(run.begin, x_begin);
+      const int end = std::min<int>(run.end, x_end);
+      if (begin >= end) {
+        continue;
+      }
+      if (run.blend || opacity != 255) {
+        BlendPixels32(&dst_row[begin], &src_row[begin], end - begin, opacity, !has_alpha_);
+      } else {
+        memcpy(&dst_row[begin], &src_row[begin], 4 * (end - begin));
       }
     }
   }
 }
 
+/**
+ * @brief 各行を、描かなくてよい画素を除いた区間に分け直す。
+ *
+ * 透過色の画素とアルファが 0 の画素は描かない。
+ * アルファが 255 でない画素が続く区間は合成が必要な区間とする。
+ */
+void Window::UpdateRuns() {
+  const auto format = shadow_buffer_.Config().pixel_format;
+  const bool use_key = transparent_color_.has_value();
+  const uint32_t key = use_key ? PackPixel(format, transparent_color_.value()) & 0xffffffu : 0;
+  // 0: 描かない、1: コピー、2: 合成
+  auto classify = [&](uint32_t px) {
+    if (use_key && (px & 0xffffffu) == key) {
+      return 0;
+    }
+    if (!has_alpha_) {
+      return 1;
+    }
+    const uint32_t a = px >> 24;
+    return a == 0 ? 0 : a == 255 ? 1 : 2;
+  };
+
+  runs_.clear();
+  row_runs_begin_.resize(height_ + 1);
+  for (int y = 0; y < height_; y++) {
+    row_runs_begin_[y] = runs_.size();
+    const uint32_t* row = shadow_buffer_.RowAt(y);
+    int x = 0;
+    while (x < width_) {
+      const int kind = classify(row[x]);
+      const int begin = x;
+      while (x < width_ && classify(row[x]) == kind) {
+        x++;
+      }
+      if (kind != 0) {
+        runs_.push_back({static_cast<uint16_t>(begin), static_cast<uint16_t>(x), kind == 2});
+      }
+    }
+  }
+  row_runs_begin_[height_] = runs_.size();
+  runs_dirty_ = false;
+}
+
 void Window::SetTransparentColor(std::optional<PixelColor> c) {
   transparent_color_ = c;
+  runs_dirty_ = true;
+}
+
+void Window::SetHasAlpha(bool has_alpha) {
+  has_alpha_ = has_alpha;
+  runs_dirty_ = true;
 }
 
 Window::WindowWriter* Window::Writer() {
   return &writer_;
 }
 
-const PixelColor& Window::At(Vector2D<int> pos) const {
-  return data_[pos.y][pos.x];
+PixelColor Window::At(Vector2D<int> pos) const {
+  return UnpackPixel(shadow_buffer_.Config().pixel_format, shadow_buffer_.RowAt(pos.y)[pos.x]);
 }
 
 void Window::Write(Vector2D<int> pos, PixelColor c) {
-  data_[pos.y][pos.x] = c;
+  runs_dirty_ = true;
   shadow_buffer_.Writer().Write(pos, c);
 }
 
+void Window::FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor& c) {
+  runs_dirty_ = true;
+  shadow_buffer_.Writer().FillRect(pos, size, c);
+}
+
+void Window::WriteRow(Vector2D<int> pos, const PixelColor* colors, int len) {
+  runs_dirty_ = true;
+  shadow_buffer_.Writer().WriteRow(pos, colors, len);
+}
+
 int Window::Width() const {
   return width_;
 }
@@ -96,6 +183,7 @@ Vector2D<int> Window::Size() const {
 }
 
 void Window::Move(Vector2D<int> dst_pos, const Rectangle<int>& src) {
+  runs_dirty_ = true;
   shadow_buffer_.Move(dst_pos, src);
 }
 
@@ -180,6 +268,7 @@ void DrawWindowTitle(PixelWriter& writer, const char* title, bool active) {
   FillRectangle(writer, {3, 3}, {win_w - 6, 18}, ToColor(bgcolor));
   WriteString(writer, {24, 4}, title, ToColor(0xffffff));
 
+  PixelColor row[kCloseButtonWidth];
   for (int y = 0; y < kCloseButtonHeight; y++) {
     for (int x = 0; x < kCloseButtonWidth; x++) {
       PixelColor c = ToColor(0xffffff);
@@ -190,7 +279,8 @@ void DrawWindowTitle(PixelWriter& writer, const char* title, bool active) {
       } else if (close_button[y][x] == ':') {
         c = ToColor(0xc6c6c6);
       }
-      writer.Write({win_w - 5 - kCloseButtonWidth + x, 5 + y}, c);
+      row[x] = c;
     }
+    writer.WriteRow({win_w - 5 - kCloseButtonWidth, 5 + y}, row, kCloseButtonWidth);
   }
 }
@@ -10,6 +10,7 @@
 #include <string>
 #include "graphics.hpp"
 #include "frame_buffer.hpp"
+#include "surface.hpp"
 
 /** @brief Window クラスはグラフィックの表示領域を表す
  *
@@ -30,6 +31,15 @@ class Window {
     virtual int Width() const override { return window_.Width(); }
     /** @brief Height は関連付けられた Window の高さをピクセル単位で返す。 */
     virtual int Height() const override { return window_.Height(); }
+    virtual void FillSpan(Vector2D<int> pos, int len, const PixelColor& c) override {
+      window_.FillRect(pos, {len, 1}, c);
+    }
+    virtual void FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor& c) override {
+      window_.FillRect(pos, size, c);
+    }
+    virtual void WriteRow(Vector2D<int> pos, const PixelColor* colors, int len) override {
+      window_.WriteRow(pos, colors, len);
+    }
 
    private:
     Window& window_;
@@ -47,16 +57,38 @@ class Window {
    * @param pos dst の左上を基準としたウィンドウの位置
    * @param area dst の左上を基準とした描画位置
    */
-  void DrawTo(FrameBuffer& dst, Vector2D<int> pos, const Rectangle<int>& area);
+  void DrawTo(FrameBuffer& dst, Vector2D<int> pos, const Rectangle<int>& area,
+              uint8_t opacity = 255);
   /** @brief 透過色を設定する。 */
   void SetTransparentColor(std::optional<PixelColor> c);
+  /** @brief 画素ごとのアルファを使うかを設定する。
+   *
+   * 使う場合、各画素の予約バイトを乗算済みアルファとして下のレイヤーと合成する。
+   * 書き込む色の PixelColor::a がそのままアルファになる。
+   */
+  void SetHasAlpha(bool has_alpha);
+  /** @brief 透過色もアルファも使わず、描くと下のレイヤーを完全に覆うか */
+  bool IsOpaque() const { return !transparent_color_ && !has_alpha_; }
   /** @brief このインスタンスに紐付いた WindowWriter を取得する。 */
   WindowWriter* Writer();
+  /** @brief ウィンドウ全体を指す Surface を f に渡して描かせる。
+   *
+   * まとめて描くときは、1 ピクセルごとに仮想関数を呼ぶ Writer() よりこちらを使う。
+   */
+  template <class F>
+  void Paint(F&& f) {
+    runs_dirty_ = true;
+    VisitSurface(shadow_buffer_.Config(), f);
+  }
 
   /** @brief 指定した位置のピクセルを返す。 */
-  const PixelColor& At(Vector2D<int> pos) const;
+  PixelColor At(Vector2D<int> pos) const;
   /** @brief 指定した位置にピクセルを書き込む。 */
   void Write(Vector2D<int> pos, PixelColor c);
+  /** @brief 矩形を c で塗る。ウィンドウからはみ出す部分は無視する。 */
+  void FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor& c);
+  /** @brief pos から右へ colors[0] 〜 colors[len - 1] を書き込む。ウィンドウからはみ出す部分は無視する。 */
+  void WriteRow(Vector2D<int> pos, const PixelColor* colors, int len);
 
   /** @brief 平面描画領域の横幅をピクセル単位で返す。 */
   int Width() const;
@@ -78,10 +110,25 @@ class Window {
 
  private:
   int width_, height_;
-  std::vector<std::vector<PixelColor>> data_{};
   WindowWriter writer_{*this};
   std::optional<PixelColor> transparent_color_{std::nullopt};
+  /** @brief ウィンドウの画素の唯一の保存先。画面と同じ画素形式で、読み出しもここから行う。 */
   FrameBuffer shadow_buffer_{};
+
+  bool has_alpha_{false};
+
+  /** @brief 透過色かアルファを使うウィンドウで、1 行の中の描くべき区間 [begin, end) */
+  struct Run {
+    uint16_t begin, end;
+    /** @brief 下のレイヤーとの合成が必要な区間か。偽ならそのままコピーする。 */
+    bool blend;
+  };
+  /** @brief 全行の区間を行順に並べたもの。y 行目の区間は row_runs_begin_[y] から row_runs_begin_[y + 1] の手前まで。 */
+  std::vector<Run> runs_{};
+  std::vector<uint32_t> row_runs_begin_{};
+  /** @brief 画素が書き換えられ、区間を求め直す必要がある */
+  bool runs_dirty_{true};
+  void UpdateRuns();
 };
 
 // タイトルバー付きの Window
@@ -98,6 +145,15 @@ class ToplevelWindow : public Window {
     virtual void Write(Vector2D<int> pos, const PixelColor& c) override {
       window_.Write(pos + kTopLeftMargin, c);
     }
+    virtual void FillSpan(Vector2D<int> pos, int len, const PixelColor& c) override {
+      window_.FillRect(pos + kTopLeftMargin, {len, 1}, c);
+    }
+    virtual void FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor& c) override {
+      window_.FillRect(pos + kTopLeftMargin, size, c);
+    }
+    virtual void WriteRow(Vector2D<int> pos, const PixelColor* colors, int len) override {
+      window_.WriteRow(pos + kTopLeftMargin, colors, len);
+    }
     virtual int Width() const override {
       return window_.Width() - kTopLeftMargin.x - kBottomRightMargin.x; 
     }
@@ -117,6 +173,12 @@ class ToplevelWindow : public Window {
 
   InnerAreaWriter* InnerWriter() { return &inner_writer_; }
   Vector2D<int> InnerSize() const;
+  /** @brief タイトルバーと枠を除いた内側を指す Surface を f に渡して描かせる。 */
+  template <class F>
+  void PaintInner(F&& f) {
+    const Rectangle<int> inner{kTopLeftMargin, InnerSize()};
+    Paint([&f, inner](auto surface) { f(surface.Sub(inner)); });
+  }
 
  private:
   std::string title_;
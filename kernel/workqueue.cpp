@@ -0,0 +1,69 @@
+#include "workqueue.hpp"
+
+#include "task.hpp"
+
+namespace {
+  void TaskWorker(uint64_t task_id, int64_t data) {
+    reinterpret_cast<WorkQueue*>(data)->Run(task_id);
+  }
+}
+
+bool WorkQueue::Schedule(Work* work) {
+  LockGuard guard{lock_};
+  if (work->pending_) {
+    return false;
+  }
+
+  work->pending_ = true;
+  work->next_ = nullptr;
+  if (tail_) {
+    tail_->next_ = work;
+  } else {
+    head_ = work;
+  }
+  tail_ = work;
+
+  if (worker_task_id_ != 0) {
+    task_manager->Wakeup(worker_task_id_);
+  }
+  return true;
+}
+
+void WorkQueue::Run(uint64_t worker_task_id) {
+  Task& task = task_manager->CurrentTask();
+  {
+    LockGuard guard{lock_};
+    worker_task_id_ = worker_task_id;
+  }
+
+  while (true) {
+    Work* work;
+    {
+      LockGuard guard{lock_};
+      while (head_ == nullptr) {
+        lock_.ReleaseWhile([&task]{ task.Sleep(); });
+      }
+
+      work = head_;
+      head_ = work->next_;
+      if (head_ == nullptr) {
+        tail_ = nullptr;
+      }
+      // 実行中に届いた登録で再実行されるよう、実行前に待ち状態を解除する
+      work->pending_ = false;
+    }
+
+    work->func_(work->data_);
+  }
+}
+
+WorkQueue* work_queue;
+
+void InitializeWorkQueue() {
+  work_queue = new WorkQueue;
+
+  const uint64_t worker_id = task_manager->NewTask()
+    .InitContext(TaskWorker, reinterpret_cast<int64_t>(work_queue))
+    .ID();
+  task_manager->Wakeup(worker_id, TaskManager::kMaxLevel);
+}
@@ -0,0 +1,64 @@
+/**
+ * @file workqueue.hpp
+ *
+ * 割り込みハンドラから処理を後回しにするための仕組み（ワークキュー）を提供する。
+ *
+ * 割り込みハンドラは Work を登録するだけで戻り、実際の処理は
+ * 優先度の高いワーカータスクが割り込み許可状態で実行する。
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "spinlock.hpp"
+
+class WorkQueue;
+
+using WorkFunc = void (int64_t data);
+
+/** @brief 後回しにする処理 1 件。
+ *
+ * 同じ Work を実行前に何度登録しても 1 回にまとめられる。
+ * 実行が始まった後に登録されたら、もう一度実行される。
+ * キューに入っている間は破棄してはならないので、通常は静的な変数として定義する。
+ */
+class Work {
+ public:
+  constexpr Work(WorkFunc* func, int64_t data = 0) : func_{func}, data_{data} {}
+  Work(const Work&) = delete;
+  Work& operator=(const Work&) = delete;
+
+  /** @brief キューに入っていて実行を待っているか */
+  bool Pending() const { return pending_; }
+
+ private:
+  WorkFunc* func_;
+  int64_t data_;
+  Work* next_{nullptr};
+  bool pending_{false};
+
+  friend WorkQueue;
+};
+
+class WorkQueue {
+ public:
+  /** @brief work を登録し、ワーカータスクを起こす。割り込みハンドラからも呼べる。
+   *
+   * @return 新たに登録したら true、すでに実行待ちだった（まとめられた）なら false
+   */
+  bool Schedule(Work* work);
+  /** @brief ワーカータスクの本体。登録された Work を順に実行し続ける。 */
+  [[noreturn]] void Run(uint64_t worker_task_id);
+
+ private:
+  SpinLock lock_;
+  Work* head_{nullptr};
+  Work* tail_{nullptr};
+  uint64_t worker_task_id_{0};
+};
+
+/** @brief システム共通のワークキュー。ワーカータスクは最高レベルで動く。 */
+extern WorkQueue* work_queue;
+
+void InitializeWorkQueue();